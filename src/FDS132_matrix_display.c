@@ -34,7 +34,7 @@ Start GPL license:
 
 /*
 Compile this source with:
- gcc -O2 -Wall -o FDS132_matrix_display FDS132_matrix_display.c ; strip FDS132_matrix_display
+ gcc -O2 -Wall -o FDS132_matrix_display FDS132_matrix_display.c -lpthread ; strip FDS132_matrix_display
 
 Install (as root, perhaps use sudo)
  cp FDS132_matrix_display /usr/local/bin/
@@ -42,7 +42,7 @@ Install (as root, perhaps use sudo)
 */
 
 
-#define PROGRAM_VERSION 	"0.4.5"
+#define PROGRAM_VERSION 	"0.5"
 
 
 /*
@@ -94,14 +94,75 @@ Added support for locale date formatting
 0.4.5
 Added support for reading a file (-f) and reading updates from that file after -q seconds interval
 Moved the i, l and : a bit more to the middle of the character space
+
+0.5
+Added packed framebuffer, text is only rendered from the font when it changes, the refresh loop streams the framebuffer.
+Added row programs, each framebuffer row is compiled into a list of GPIO set / clear register writes that the refresh loop replays,
+ data low is merged with the clock low write, unchanged data is not written again.
+Replaced the feof() delay loop by a spin delay calibrated against CLOCK_MONOTONIC_RAW at startup, -n sets the delay in nanoseconds,
+ -v reports the resulting bit clock.
+Moved the refresh to its own thread, the main thread produces frames and hands them over with a lock free triple buffer,
+ -p runs the refresh thread SCHED_FIFO, -a pins it to a CPU, -m locks memory.
+Added a scheduler, scroll steps, effects, date and file updates run at millisecond deadlines instead of counting refresh loops,
+ -s and -w are now in milliseconds.
+Padded the effect landscapes to 15 characters.
+Horizontal scroll moves one pixel at a time, characters are rendered once into a strip that the display is a window on.
+Vertical scroll moves one pixel row at a time, the new line is rendered once off screen and slides in, then waits for the scroll delay.
+Added an event loop, stdin is read in bulk into a ring buffer when ppoll() says there is data, the main thread never blocks on input.
+The -f file is watched with inotify, also for rename over, and read with pread() on an open descriptor,
+ a missing file no longer stops the program, -q is only used if inotify is not available.
+The -d date is formatted once per second on the second boundary, only changed characters are rendered again.
+Added GPIO backends (-g): mem, gpiomem and sim, a simulated display that decodes the pins into a panel image
+ and counts register writes and edges, to test and benchmark without hardware.
+Added the cdev GPIO backend on the GPIO character device, all lines in one request, clear and set merged in one ioctl,
+ -v reports the bit clock per backend for comparison.
+Added the spi backend, each row is packed into 34 bytes and shifted out in one spidev transfer,
+ strobe and row select stay on GPIO, needs data on MOSI (GPIO10), spi:sim feeds the bytes to the simulated display.
+Added a benchmark, make bench, it measures refresh, render, scroll and effect speed on the simulated display
+ and prints key=value results.
+Added telemetry, -S opens a Unix socket that answers row, frame and refresh interval histograms, task lateness,
+ missed deadlines, input bytes and render counts in the Prometheus text format.
+Every row is lit for the same time, the next row is shifted in while a row is lit, the panel is blanked (row 7)
+ for the strobe and for anything else the refresh thread does, so the last row is no longer brighter,
+ -r sets the row time, the ghost of the next row and the font row fix are gone.
+Added brightness, -b 1 to 16 or a time of day schedule, the panel is blanked for the rest of each row period,
+ the refresh thread sleeps through long blank parts, the stats socket command brightness sets it at runtime.
+Added grayscale, -G 2 to 4 bits per pixel with binary code modulation, each row is scanned once per bitplane,
+ with a fade time text changes fade in and out, -v and the stats report the refresh rate.
+Added eco refresh, -E, a fixed row period, the rest of the row after the shift is slept with clock_nanosleep(),
+ the benchmark reports the CPU use of the spinning and the eco refresh.
+Added display off, brightness 0 in the -b schedule or from the stats socket latches zeros, selects row 7
+ and parks the refresh thread until the brightness is set again, SIGINT, SIGTERM, SIGHUP and the exit on EOF
+ leave the panel dark and remove the stats socket.
+The font is turned into a table of 6 pixel row slices at startup, whole text rows are packed with lookups and ORs,
+ no bit by bit font access and ASCII check per pixel while rendering.
+Full texts are rendered 8 characters at a time with an 8 x 8 transpose and packing in NEON or SSE2 registers,
+ the benchmark compares it with the row at a time reference and checks they are bit exact.
+Added proportional fonts, -F loads a BDF or PSF font, or the built in one trimmed, into a 4 kB glyph atlas
+ with a width per glyph, written once and memory mapped on later starts, text, date, marquee and vertical
+ scroll fit as many characters on a line as there is room for.
+Added UTF-8 input, stdin, -t, -f and the date are decoded to a code page like Windows-1252 with Latin-1,
+ the euro sign and common symbols, accented letters are made from the ASCII ones at startup, a code point
+ is looked up in 2 steps, broken sequences show as a single ?, where bytes above 127 used to be dropped.
+Added large glyphs, -L 2 or 3, the first line of -d, -t or -f is drawn 14 or 21 pixels high and centred,
+ the glyphs are scaled once at startup, -d -L 3 shows the time in big digits, -d -L 2 with the seconds
+ and the date below them.
 */
 
 
 
+#define _GNU_SOURCE		/* CPU affinity */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <linux/spi/spidev.h>
 #include <unistd.h>
 #include <errno.h>
 //#include <sys/types.h>
@@ -111,10 +172,29 @@ Moved the i, l and : a bit more to the middle of the character space
 #include <ctype.h>
 #include <time.h>
 #include <locale.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 //#include <math.h>
 
 
-#define IO_DELAY	5	/* delay loop */
+#define DEFAULT_BIT_DELAY_NS	300	/* setup and hold time after each GPIO write */
+#define ROW_MARGIN_PERCENT		10	/* row time over the slowest shift */
+#define BRIGHTNESS_MAX			16	/* brightness 1 to 16, lit 1/16 to 16/16 of the row period */
+#define GRAY_PLANES_MAX			4	/* bits per pixel with -G */
 
 
 /* character font for Panteltje (c) FDS132 LED matrix display */
@@ -1192,6 +1272,7 @@ free:
 #define MATRIX_ROW_SELECT_A				1<<22
 #define MATRIX_ROW_SELECT_B				1<<23
 #define MATRIX_ROW_SELECT_C				1<<24
+#define MATRIX_ROW_BLANK				(MATRIX_ROW_SELECT_A | MATRIX_ROW_SELECT_B | MATRIX_ROW_SELECT_C) /* row 7 is not connected */
 
 
 // Access from ARM Running Linux
@@ -1212,6 +1293,40 @@ void *gpio_map;
 // I/O access
 volatile unsigned *gpio;
 
+struct row_program;
+
+struct gpio_backend
+	{
+	char *name;
+	void (*open)();
+	void (*set)(uint32_t mask);
+	void (*clr)(uint32_t mask);
+	void (*run)(struct row_program *prog, int from, int to);	/* ops from up to to */
+	void (*frame)();			/* optional, after each frame */
+	void (*report)();			/* optional, with -v */
+	};
+
+struct gpio_backend *backend;
+char *backend_arg;
+atomic_int backend_failed;		/* a write failed, nothing more is written */
+int backend_fail_fd = -1;		/* eventfd, the main thread ends the program */
+
+
+
+/* from the refresh thread, which must not exit itself, display_exit() runs in the main thread */
+void backend_fail(char *what)
+{
+uint64_t one;
+
+if(atomic_exchange(&backend_failed, 1) ) return;
+
+perror(what);
+
+one = 1;
+if(write(backend_fail_fd, &one, sizeof(one) ) < 0) perror("backend_fail(): write");
+
+} /* end function backend_fail */
+
 
 // GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
 #define INP_GPIO(g) *(gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
@@ -1307,24 +1422,102 @@ return p;
 
 
 
-void io_delay(int delays)
+/*
+Timing.
+The delay after each GPIO write is a spin loop, calibrated at startup against CLOCK_MONOTONIC_RAW.
+The CPU is kept busy for a while before calibrating, so the cpufreq governor has ramped up to the highest clock,
+if the clock drops later the delays only get longer, never shorter.
+*/
+int bit_delay_ns;
+uint32_t delay_loops;
+double loops_per_ns;
+
+
+
+int64_t monotonic_ns()
+{
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+return ( (int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+} /* end function monotonic_ns */
+
+
+
+static inline void spin(uint32_t loops)
+{
+while(loops--)
+	{
+	__asm__ __volatile__("" ::: "memory");
+	}
+
+} /* end function spin */
+
+
+
+void calibrate_delay()
 {
 int i;
+uint32_t loops;
+int64_t start, elapsed, best;
 
-for(i = 0; i < delays; i++)
+// warm up, let cpufreq go to full speed
+start = monotonic_ns();
+while(monotonic_ns() - start < 100000000LL)
 	{
-	/* some delay */
-	feof(stdin);
+	spin(1000);
 	}
 
+// find a loop count that takes at least 2 ms
+loops = 1000;
+while(1)
+	{
+	start = monotonic_ns();
+	spin(loops);
+	elapsed = monotonic_ns() - start;
+
+	if(elapsed >= 2000000LL) break;
+
+	loops *= 2;
+	}
+
+// fastest of a few runs, interrupts and preemption only make a run slower
+best = elapsed;
+for(i = 0; i < 8; i++)
+	{
+	start = monotonic_ns();
+	spin(loops);
+	elapsed = monotonic_ns() - start;
+
+	if(elapsed < best) best = elapsed;
+	}
+
+loops_per_ns = (double)loops / (double)best;
+
+delay_loops = (uint32_t)( (bit_delay_ns * loops_per_ns) + 0.5);
+
+if(verbose)
+	{
+	fprintf(stderr, "calibrate_delay(): %.3f loops per ns, bit delay %d ns is %u loops\n", loops_per_ns, bit_delay_ns, delay_loops);
+	}
+
+} /* end function calibrate_delay */
+
+
+
+static inline void io_delay()
+{
+spin(delay_loops);
+
 } /* end function io_delay */
 
 
 
 void so_h()
 {
-*(gpio + 7) = MATRIX_SHIFT_REGISTER_DATA;
-io_delay(IO_DELAY);
+backend->set(MATRIX_SHIFT_REGISTER_DATA);
+io_delay();
 
 } /* end functiom so_h */
 
@@ -1332,8 +1525,8 @@ io_delay(IO_DELAY);
 
 void so_l()
 {
-*(gpio + 10) = MATRIX_SHIFT_REGISTER_DATA;
-io_delay(IO_DELAY);
+backend->clr(MATRIX_SHIFT_REGISTER_DATA);
+io_delay();
 
 } /* end function so_l */
 
@@ -1341,8 +1534,8 @@ io_delay(IO_DELAY);
 
 void sck_h()
 {
-*(gpio + 7) = MATRIX_SHIFT_REGISTER_CLOCK;
-io_delay(IO_DELAY);
+backend->set(MATRIX_SHIFT_REGISTER_CLOCK);
+io_delay();
 
 } /* end function sck_h */
 
@@ -1350,8 +1543,8 @@ io_delay(IO_DELAY);
 
 void sck_l()
 {
-*(gpio + 10) = MATRIX_SHIFT_REGISTER_CLOCK;
-io_delay(IO_DELAY);
+backend->clr(MATRIX_SHIFT_REGISTER_CLOCK);
+io_delay();
 
 } /* end function sck_l */
 
@@ -1359,8 +1552,8 @@ io_delay(IO_DELAY);
 
 void strobe_h()
 {
-*(gpio + 7) = MATRIX_STROBE;
-io_delay(IO_DELAY);
+backend->set(MATRIX_STROBE);
+io_delay();
 
 } /* end function strobe_h */
 
@@ -1368,8 +1561,8 @@ io_delay(IO_DELAY);
 
 void strobe_l()
 {
-*(gpio + 10) = MATRIX_STROBE;
-io_delay(IO_DELAY);
+backend->clr(MATRIX_STROBE);
+io_delay();
 
 } /* end function  strobe_l */
 
@@ -1377,8 +1570,8 @@ io_delay(IO_DELAY);
 
 void row_select_a_high()
 {
-*(gpio + 7) = MATRIX_ROW_SELECT_A;
-io_delay(IO_DELAY);
+backend->set(MATRIX_ROW_SELECT_A);
+io_delay();
 
 } /* end function row_select_a_high */
 
@@ -1386,8 +1579,8 @@ io_delay(IO_DELAY);
 
 void row_select_a_low()
 {
-*(gpio + 10) = MATRIX_ROW_SELECT_A;
-io_delay(IO_DELAY);
+backend->clr(MATRIX_ROW_SELECT_A);
+io_delay();
 
 } /* end function row_select_a_low */
 
@@ -1395,8 +1588,8 @@ io_delay(IO_DELAY);
 
 void row_select_b_high()
 {
-*(gpio + 7) = MATRIX_ROW_SELECT_B;
-io_delay(IO_DELAY);
+backend->set(MATRIX_ROW_SELECT_B);
+io_delay();
 
 } /* end function row_select_b_high */
 
@@ -1404,8 +1597,8 @@ io_delay(IO_DELAY);
 
 void row_select_b_low()
 {
-*(gpio + 10) =  MATRIX_ROW_SELECT_B;
-io_delay(IO_DELAY);
+backend->clr(MATRIX_ROW_SELECT_B);
+io_delay();
 
 } /* end function row_select_b_low */
 
@@ -1413,8 +1606,8 @@ io_delay(IO_DELAY);
 
 void row_select_c_high()
 {
-*(gpio + 7) = MATRIX_ROW_SELECT_C;
-io_delay(IO_DELAY);
+backend->set(MATRIX_ROW_SELECT_C);
+io_delay();
 
 } /* end function row_select_c_high */
 
@@ -1422,8 +1615,8 @@ io_delay(IO_DELAY);
 
 void row_select_c_low()
 {
-*(gpio + 10) = MATRIX_ROW_SELECT_C;
-io_delay(IO_DELAY);
+backend->clr(MATRIX_ROW_SELECT_C);
+io_delay();
 
 } /* end function row_select_c_low */
 
@@ -1452,7 +1645,7 @@ close(mem_fd); // No need to keep mem_fd open after mmap
 
 if(gpio_map == MAP_FAILED)
 	{
-	printf("mmap error %d\n", (int)gpio_map);//errno also set!
+	printf("mmap error %d\n", errno);
 	exit(-1);
 	}
 
@@ -1472,27 +1665,48 @@ fprintf(stderr,\
 "\nPanteltje FDS132_matrix_diplay-%s\n\
 Usage:\nmatrix_diplay [-e] [-h] [-l] [-v] [t]\n\
 \n\
+-a int        pin the refresh thread to this CPU.\n\
+-b level      brightness 0 (display off) to %d, or a schedule in local time: -b 7:00=16,20:00=8,23:30=2, default %d.\n\
 -d            display date and time.\n\
 -e            exit on EOF, display will go black, else last text will be displayed.\n\
+-E            eco refresh, fixed row period (-r, default 1000 us), sleep instead of spin between rows.\n\
+-g name       GPIO backend:\n\
+                mem      /dev/mem, needs root.\n\
+                gpiomem  /dev/gpiomem.\n\
+                cdev[:chip] GPIO character device, default /dev/gpiochip0.\n\
+                spi[:device[,hz]] data and clock on SPI, default /dev/spidev0.0,\n\
+                         clock 1 / (2 * bit delay), data must be on MOSI (GPIO10),\n\
+                         spi:sim shifts into the simulated display.\n\
+                sim      simulated display, printed on stdout.\n\
+                default mem.\n\
+-G bits[,ms]  grayscale, 1 to %d bits per pixel with binary code modulation, changes fade in ms, default 1.\n\
 -h            help (this help).\n\
--s int        scroll delay, default 40.\n\
+-m            lock all memory, no page faults in the refresh thread.\n\
+-n int        bit delay, setup and hold time after each GPIO write in nanoseconds, default %d.\n\
+-p int        run the refresh thread SCHED_FIFO with this priority (1-99), default 0 off.\n\
+-r int        time each row is lit in microseconds, default 0 is the slowest shift plus %d%%.\n\
+-s int        scroll delay in milliseconds, default 100.\n\
+-S path       stats socket, send stats for frame, row and task timing in the Prometheus text format.\n\
 -t text       text to display.\n\
 -f file       file to read and display.\n\
--q int        seconds between file checks.\n\
+-F font[,atlas] proportional font, BDF, PSF or builtin, at most 16 x 8, more characters per line,\n\
+              with an atlas file it is compiled once and memory mapped on later starts.\n\
+-L 2|3        large glyphs, the first line of -d, -t or -f 2 or 3 times as high, -d shows big digits.\n\
+-q int        seconds between file checks, only if inotify is not available, default 10.\n\
 -u int        scroll mode:\n\
                 0 horizontal left.\n\
                 1 vertically up.\n\
                 2 vertical down.\n\
                 default 0.\n\
 -v            verbose, prints functions and arguments.\n\
--w int        delay time to wait after displaying 3 lines in vertical scroll, default 0.\n\
+-w int        milliseconds to wait after displaying 3 lines in vertical scroll, default 0.\n\
 -x int        special effects:\n\
                 0 off.\n\
                 1 snow.\n\
                 2 fireworks.\n\
                 default 0.\n\\n\
 \n",\
-PROGRAM_VERSION);
+PROGRAM_VERSION, BRIGHTNESS_MAX, BRIGHTNESS_MAX, GRAY_PLANES_MAX, DEFAULT_BIT_DELAY_NS, ROW_MARGIN_PERCENT);
 
 fprintf(stderr,\
 "Examples, \n\
@@ -1503,6 +1717,8 @@ Vertical scrolling text, keep your lines shorter than 15 characters, LF works, o
 FDS132_matrix_display -u -s 400 < example.txt\n\n\
 Display date and time:\n\
 FDS132_matrix_display -d\n\n\
+Display the time in digits 21 pixels high:\n\
+FDS132_matrix_display -d -L 3\n\n\
 Put a specific text on the display, use spaces to format:\n\
 FDS132_matrix_display -t \"Hello world\"\n\
 \n"\
@@ -1511,653 +1727,5590 @@ FDS132_matrix_display -t \"Hello world\"\n\
 } /* end function print_usage */
 
 
-char text[60];
+char text[128];		/* 3 lines of 15 characters, with -F as many as fit */
 
-uint8_t data[7][50];
 
+/*
+The shift register chain runs through all three text lines, 3 x 90 = 270 bits.
+Chain position p = (line * 90) + x, the bit for p = 269 is shifted in first.
+The framebuffer holds one packed 270 bit row per font row, pixel p in bit (p & 31) of word (p >> 5).
+*/
+#define MATRIX_ROWS				7
+#define MATRIX_LINES			3
+#define MATRIX_LINE_CHARS		15
+#define MATRIX_LINE_MAX			MATRIX_LINE_PIXELS	/* characters on a line with -F, 1 pixel each at most */
+#define MATRIX_LINE_PIXELS		90
+#define MATRIX_CHARS			(MATRIX_LINES * MATRIX_LINE_CHARS)
+#define MATRIX_CHAIN_BITS		(MATRIX_LINES * MATRIX_LINE_PIXELS)
+#define FONT_PITCH				6	/* pixels per character, font bits 7 to 2 */
 
-#define SCROLL_LEFT		0
-#define SCROLL_UP		1
-#define	SCROLL_DOWN		2
+#define FB_WORDS				( (MATRIX_CHAIN_BITS + 31) / 32)
 
+uint32_t framebuffer[MATRIX_ROWS][FB_WORDS];
+char rendered_text[sizeof(text)];
+int framebuffer_valid;
+int framebuffer_dirty;		/* framebuffer changed other than by framebuffer_update() */
+uint64_t chars_rendered;	/* by framebuffer_update() */
 
-#define EFFECT_OFF 							0
-#define EFFECT_SNOW							1
-#define EFFECT_FIREWORKS					2
 
 
-int main(int argc, char **argv)
+/*
+Code page.
+The display has 256 glyphs: ASCII, and above it a code page like Windows-1252, Latin-1 in 0xa0 to 0xff,
+the euro sign at 0x80 and the quotes, dashes and other symbols of Windows-1252 in 0x81 to 0x9f.
+Accented letters are made from the ASCII letter and an accent when the glyphs are made, the rest are
+drawn here, 7 rows of 5 pixels. An upper case letter has no room above it, one of its repeated rows goes.
+glyph_page[] maps a code point to its glyph in two steps, by the high and the low byte.
+*/
+#define ACCENT_NONE				0
+#define ACCENT_GRAVE			1
+#define ACCENT_ACUTE			2
+#define ACCENT_CIRCUMFLEX		3
+#define ACCENT_TILDE			4
+#define ACCENT_DIAERESIS		5
+#define ACCENT_RING				6
+#define ACCENT_CARON			7
+#define ACCENT_CEDILLA			8		/* below, the letter moves up a row */
+#define ACCENT_STROKE			9		/* through */
+#define ACCENT_FLIP				10		/* turned half way round */
+
+#define GLYPH_PAGES				8		/* 256 code points each */
+#define GLYPH_UNKNOWN			'?'		/* for a code point without a glyph */
+
+struct accent
+	{
+	char *top;						/* 2 rows above a lower case letter */
+	char *near;
+	char *upper;					/* 1 row above an upper case letter */
+	};
+
+struct accent accents[] =
+	{
+	{ NULL, NULL, NULL },
+	{ ".#...", "..#..", ".#..." },
+	{ "...#.", "..#..", "...#." },
+	{ "..#..", ".#.#.", ".###." },
+	{ ".##.#", "#..#.", ".##.#" },
+	{ ".#.#.", ".....", ".#.#." },
+	{ ".###.", ".#.#.", "..#.." },
+	{ ".#.#.", "..#..", "..#.." },
+	};
+
+struct code_page_glyph
+	{
+	uint8_t code;
+	uint16_t unicode;
+	char base;						/* ASCII glyph it is made from, 0 is drawn in rows */
+	uint8_t accent;
+	char *rows;						/* 7 rows of 5 pixels, # is on */
+	};
+
+struct code_page_glyph code_page[] =
+	{
+	{ 0x80, 0x20ac, 0, 0, "..### .#... ####. .#... ####. .#... ..###" },	/* euro */
+	{ 0x82, 0x201a, ',', 0, NULL },
+	{ 0x83, 0x0192, 'f', 0, NULL },
+	{ 0x84, 0x201e, 0, 0, "..... ..... ..... ..... ..... .#.#. #.#.." },
+	{ 0x85, 0x2026, 0, 0, "..... ..... ..... ..... ..... ..... #.#.#" },
+	{ 0x86, 0x2020, 0, 0, "..#.. ##### ..#.. ..#.. ..#.. ..#.. ....." },
+	{ 0x87, 0x2021, 0, 0, "..#.. ##### ..#.. ..#.. ##### ..#.. ....." },
+	{ 0x88, 0x02c6, '^', 0, NULL },
+	{ 0x89, 0x2030, '%', 0, NULL },
+	{ 0x8a, 0x0160, 'S', ACCENT_CARON, NULL },
+	{ 0x8b, 0x2039, 0, 0, "..... ..... ...#. ..#.. .#... ..#.. ...#." },
+	{ 0x8c, 0x0152, 0, 0, ".#### #.#.. #.#.. #.### #.#.. #.#.. .####" },
+	{ 0x8e, 0x017d, 'Z', ACCENT_CARON, NULL },
+	{ 0x91, 0x2018, '\'', 0, NULL },
+	{ 0x92, 0x2019, '\'', 0, NULL },
+	{ 0x93, 0x201c, '"', 0, NULL },
+	{ 0x94, 0x201d, '"', 0, NULL },
+	{ 0x95, 0x2022, 0, 0, "..... ..... .###. .###. .###. ..... ....." },
+	{ 0x96, 0x2013, '-', 0, NULL },
+	{ 0x97, 0x2014, 0, 0, "..... ..... ..... ##### ..... ..... ....." },
+	{ 0x98, 0x02dc, '~', 0, NULL },
+	{ 0x99, 0x2122, 0, 0, "###.. .#... .#... ##.## #.#.# #...# ....." },
+	{ 0x9a, 0x0161, 's', ACCENT_CARON, NULL },
+	{ 0x9b, 0x203a, 0, 0, "..... ..... .#... ..#.. ...#. ..#.. .#..." },
+	{ 0x9c, 0x0153, 0, 0, "..... ..... .#.#. #.#.# #.### #.#.. .#.##" },
+	{ 0x9e, 0x017e, 'z', ACCENT_CARON, NULL },
+	{ 0x9f, 0x0178, 'Y', ACCENT_DIAERESIS, NULL },
+	{ 0xa0, 0x00a0, ' ', 0, NULL },
+	{ 0xa1, 0x00a1, 0, 0, "..#.. ..... ..#.. ..#.. ..#.. ..#.. ..#.." },
+	{ 0xa2, 0x00a2, 0, 0, "..... ..#.. .#### #.#.. #.#.. .#### ..#.." },
+	{ 0xa3, 0x00a3, 0, 0, "..##. .#..# .#... ###.. .#... .#... #####" },
+	{ 0xa4, 0x00a4, 0, 0, "..... #...# .###. .#.#. .###. #...# ....." },
+	{ 0xa5, 0x00a5, 0, 0, "#...# .#.#. ##### ..#.. ##### ..#.. ..#.." },
+	{ 0xa6, 0x00a6, 0, 0, "..#.. ..#.. ..#.. ..... ..#.. ..#.. ..#.." },
+	{ 0xa7, 0x00a7, 0, 0, ".###. #.... .###. #...# .###. ....# .###." },
+	{ 0xa8, 0x00a8, 0, 0, ".#.#. ..... ..... ..... ..... ..... ....." },
+	{ 0xa9, 0x00a9, 'C', 0, NULL },
+	{ 0xaa, 0x00aa, 'a', 0, NULL },
+	{ 0xab, 0x00ab, 0, 0, "..... ..#.# .#.#. #.#.. .#.#. ..#.# ....." },
+	{ 0xac, 0x00ac, 0, 0, "..... ..... ##### ....# ..... ..... ....." },
+	{ 0xad, 0x00ad, '-', 0, NULL },
+	{ 0xae, 0x00ae, 'R', 0, NULL },
+	{ 0xaf, 0x00af, 0, 0, "##### ..... ..... ..... ..... ..... ....." },
+	{ 0xb0, 0x00b0, 0, 0, ".##.. #..#. #..#. .##.. ..... ..... ....." },
+	{ 0xb1, 0x00b1, 0, 0, "..#.. ..#.. ##### ..#.. ..#.. ..... #####" },
+	{ 0xb2, 0x00b2, 0, 0, ".##.. ...#. ..#.. .###. ..... ..... ....." },
+	{ 0xb3, 0x00b3, 0, 0, ".##.. ..#.. ...#. .##.. ..... ..... ....." },
+	{ 0xb4, 0x00b4, 0, 0, "...#. ..#.. ..... ..... ..... ..... ....." },
+	{ 0xb5, 0x00b5, 0, 0, "..... ..... #...# #...# #..## ###.# #...." },
+	{ 0xb6, 0x00b6, 0, 0, ".#### ###.# ###.# .##.# ..#.# ..#.# ..#.#" },
+	{ 0xb7, 0x00b7, 0, 0, "..... ..... ..... ..#.. ..... ..... ....." },
+	{ 0xb8, 0x00b8, 0, 0, "..... ..... ..... ..... ..... ..#.. .##.." },
+	{ 0xb9, 0x00b9, 0, 0, "..#.. .##.. ..#.. .###. ..... ..... ....." },
+	{ 0xba, 0x00ba, 'o', 0, NULL },
+	{ 0xbb, 0x00bb, 0, 0, "..... #.#.. .#.#. ..#.# .#.#. #.#.. ....." },
+	{ 0xbc, 0x00bc, 0, 0, "#...# #..#. #.#.. .#... ..#.# ..### ....#" },
+	{ 0xbd, 0x00bd, 0, 0, "#...# #..#. #.#.. .#... ..##. ...#. ...##" },
+	{ 0xbe, 0x00be, 0, 0, "##..# .#.#. ###.. .#... ..#.# ..### ....#" },
+	{ 0xbf, 0x00bf, '?', ACCENT_FLIP, NULL },
+	{ 0xc0, 0x00c0, 'A', ACCENT_GRAVE, NULL },
+	{ 0xc1, 0x00c1, 'A', ACCENT_ACUTE, NULL },
+	{ 0xc2, 0x00c2, 'A', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xc3, 0x00c3, 'A', ACCENT_TILDE, NULL },
+	{ 0xc4, 0x00c4, 'A', ACCENT_DIAERESIS, NULL },
+	{ 0xc5, 0x00c5, 'A', ACCENT_RING, NULL },
+	{ 0xc6, 0x00c6, 0, 0, ".#### #.#.. #.#.. ##### #.#.. #.#.. #.###" },
+	{ 0xc7, 0x00c7, 'C', ACCENT_CEDILLA, NULL },
+	{ 0xc8, 0x00c8, 'E', ACCENT_GRAVE, NULL },
+	{ 0xc9, 0x00c9, 'E', ACCENT_ACUTE, NULL },
+	{ 0xca, 0x00ca, 'E', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xcb, 0x00cb, 'E', ACCENT_DIAERESIS, NULL },
+	{ 0xcc, 0x00cc, 'I', ACCENT_GRAVE, NULL },
+	{ 0xcd, 0x00cd, 'I', ACCENT_ACUTE, NULL },
+	{ 0xce, 0x00ce, 'I', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xcf, 0x00cf, 'I', ACCENT_DIAERESIS, NULL },
+	{ 0xd0, 0x00d0, 0, 0, "###.. .#.#. .#..# ###.# .#..# .#.#. ###.." },
+	{ 0xd1, 0x00d1, 'N', ACCENT_TILDE, NULL },
+	{ 0xd2, 0x00d2, 'O', ACCENT_GRAVE, NULL },
+	{ 0xd3, 0x00d3, 'O', ACCENT_ACUTE, NULL },
+	{ 0xd4, 0x00d4, 'O', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xd5, 0x00d5, 'O', ACCENT_TILDE, NULL },
+	{ 0xd6, 0x00d6, 'O', ACCENT_DIAERESIS, NULL },
+	{ 0xd7, 0x00d7, 0, 0, "..... #...# .#.#. ..#.. .#.#. #...# ....." },
+	{ 0xd8, 0x00d8, 'O', ACCENT_STROKE, NULL },
+	{ 0xd9, 0x00d9, 'U', ACCENT_GRAVE, NULL },
+	{ 0xda, 0x00da, 'U', ACCENT_ACUTE, NULL },
+	{ 0xdb, 0x00db, 'U', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xdc, 0x00dc, 'U', ACCENT_DIAERESIS, NULL },
+	{ 0xdd, 0x00dd, 'Y', ACCENT_ACUTE, NULL },
+	{ 0xde, 0x00de, 0, 0, "#.... ####. #...# #...# ####. #.... #...." },
+	{ 0xdf, 0x00df, 0, 0, ".###. #...# #..#. #.#.. #..#. #...# #.##." },
+	{ 0xe0, 0x00e0, 'a', ACCENT_GRAVE, NULL },
+	{ 0xe1, 0x00e1, 'a', ACCENT_ACUTE, NULL },
+	{ 0xe2, 0x00e2, 'a', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xe3, 0x00e3, 'a', ACCENT_TILDE, NULL },
+	{ 0xe4, 0x00e4, 'a', ACCENT_DIAERESIS, NULL },
+	{ 0xe5, 0x00e5, 'a', ACCENT_RING, NULL },
+	{ 0xe6, 0x00e6, 0, 0, "..... ..... ##.#. ..#.# .#### #.#.. .#.##" },
+	{ 0xe7, 0x00e7, 'c', ACCENT_CEDILLA, NULL },
+	{ 0xe8, 0x00e8, 'e', ACCENT_GRAVE, NULL },
+	{ 0xe9, 0x00e9, 'e', ACCENT_ACUTE, NULL },
+	{ 0xea, 0x00ea, 'e', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xeb, 0x00eb, 'e', ACCENT_DIAERESIS, NULL },
+	{ 0xec, 0x00ec, 'i', ACCENT_GRAVE, NULL },
+	{ 0xed, 0x00ed, 'i', ACCENT_ACUTE, NULL },
+	{ 0xee, 0x00ee, 'i', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xef, 0x00ef, 'i', ACCENT_DIAERESIS, NULL },
+	{ 0xf0, 0x00f0, 0, 0, ".#.#. ..#.. .#.#. ....# .#### #...# .###." },
+	{ 0xf1, 0x00f1, 'n', ACCENT_TILDE, NULL },
+	{ 0xf2, 0x00f2, 'o', ACCENT_GRAVE, NULL },
+	{ 0xf3, 0x00f3, 'o', ACCENT_ACUTE, NULL },
+	{ 0xf4, 0x00f4, 'o', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xf5, 0x00f5, 'o', ACCENT_TILDE, NULL },
+	{ 0xf6, 0x00f6, 'o', ACCENT_DIAERESIS, NULL },
+	{ 0xf7, 0x00f7, 0, 0, "..... ..#.. ..... ##### ..... ..#.. ....." },
+	{ 0xf8, 0x00f8, 'o', ACCENT_STROKE, NULL },
+	{ 0xf9, 0x00f9, 'u', ACCENT_GRAVE, NULL },
+	{ 0xfa, 0x00fa, 'u', ACCENT_ACUTE, NULL },
+	{ 0xfb, 0x00fb, 'u', ACCENT_CIRCUMFLEX, NULL },
+	{ 0xfc, 0x00fc, 'u', ACCENT_DIAERESIS, NULL },
+	{ 0xfd, 0x00fd, 'y', ACCENT_ACUTE, NULL },
+	{ 0xfe, 0x00fe, 0, 0, "#.... #.... ####. #...# #...# ####. #...." },
+	{ 0xff, 0x00ff, 'y', ACCENT_DIAERESIS, NULL },
+
+	/* look alikes, no glyph of their own */
+	{ '-', 0x2010, 0, 0, NULL },
+	{ '-', 0x2011, 0, 0, NULL },
+	{ '-', 0x2212, 0, 0, NULL },
+	{ ' ', 0x2009, 0, 0, NULL },
+	{ ' ', 0x202f, 0, 0, NULL },
+	{ 0, 0, 0, 0, NULL }
+	};
+
+uint8_t *glyph_page[256];					/* by the high byte of a code point, NULL is no glyphs */
+uint8_t glyph_pages[GLYPH_PAGES][256];		/* by the low byte, 0 is no glyph */
+int glyph_pages_used;
+
+
+
+/* 5 pixels of '#' and '.' to a font row, bits 6 to 2 like matrixfont */
+unsigned char glyph_art(char *art)
 {
-int a, c, i, j, r;
-int loop_counter;
-int exit_on_eof_flag;
-int text_flag;
-int date_flag;
-int file_flag;
-int scroll_delay;
-int scroll_mode;
-int three_line_delay;
-int line_cnt;
-int effect_mode;
-int input_line_cnt;
-int file_read_frequency;
-char filename[MAX_FILENAME_LEN];
-float fa;
-char fireworks_landscape[] = 	" * **  * *"; // landscape on bottom line, 15 characters wide, the control B is a christmass tree, use hexedit for example to make these strings
-char snow_landscape[] = 		" * **  * *";
-//int get_temperature_flag;
-//int temperature;
-FILE *fptr;
+int k;
+unsigned char font_row;
 
+font_row = 0;
+for(k = 0; k < 5; k++)
+	{
+	if(art[k] == '#') font_row |= 0x40 >> k;
+	}
 
-setbuf(stdout, NULL);
-setbuf(stdin, NULL);
+return font_row;
+} /* end function glyph_art */
 
-//strcpy(text, "   PANTELTJE                               ");
-strcpy(text, "                                           ");
 
-gpioHardwareRevision(); /* sets piModel, needed for peripherals address */
 
-// Set up gpio pointer for direct register access
-setup_io();
+/* an ASCII letter with an accent, or drawn, in matrixfont rows */
+void glyph_compose(unsigned char *font_row, struct code_page_glyph *g)
+{
+int r, first, last, drop, col;
+unsigned char base[MATRIX_ROWS];
 
+if(g->rows)
+	{
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		font_row[r] = glyph_art(g->rows + (r * 6) );
+		}
 
-/*
-GPIO	header Pin
-2		3
-3		5
-4		7
-7		26
-8		24
-9		21
-10		19
-11		23
-14		8
-15		10
-17		11
-18		12
-27		13
-22		15
-23		16
-24		18
-25		22
-*/
+	return;
+	}
 
+memcpy(base, matrixfont + (g->base * MATRIX_CHAR_HEIGHT), MATRIX_ROWS);
 
-/* defaults */
+// dotless i
+if(g->base == 'i') base[0] = 0;
 
-verbose = 0;
-exit_on_eof_flag = 0;
-text_flag = 0;
-date_flag = 0;
-file_flag = 0;
-scroll_delay = 40;
-three_line_delay = 0;
-line_cnt = 0;
-//get_temperature_flag = 0;
-scroll_mode = SCROLL_LEFT;
-effect_mode = EFFECT_OFF;
-input_line_cnt = 0;
-file_read_frequency = 10;
+for(first = 0; (first < MATRIX_ROWS - 1) && !base[first]; first++);
+for(last = MATRIX_ROWS - 1; (last > 0) && !base[last]; last--);
 
-/* end defaults */
+// a row that repeats the one above can go without changing the letter much, else the middle one
+for(drop = 1; (drop < MATRIX_ROWS) && (base[drop] != base[drop - 1]); drop++);
+if(drop == MATRIX_ROWS) drop = MATRIX_ROWS / 2;
 
+memcpy(font_row, base, MATRIX_ROWS);
 
-/* proces any command line arguments */
-while(1)
+switch(g->accent)
 	{
-	a = getopt(argc, argv, "cdehs:u:vw:t:x:f:q:");
-	if(a == -1) break;
+	case ACCENT_NONE:
+		break;
 
-	switch(a)
-		{
-//		case 'c': // temperature
-//			get_temperature_flag = 1;
-//			break;
-		case 'd': // dsiplay date and time
-			date_flag = 1;
-			break;
-		case 'e': // exit on EOF
-			exit_on_eof_flag = 1;
-			break;
-    case 'f':
-      file_flag = 1;
-      strncpy(filename, optarg, sizeof(filename) - 1);
-      break;
-		case 'h': // help
-			print_usage();
-			exit(1);
-			break;
-    case 'q':
-      file_read_frequency = atoi(optarg);
-      break;
-		case 's': // scroll delay
-			scroll_delay = atoi(optarg);
-			break;
-		case 't': // text to display
-			text_flag = 1;
-			strncpy(text, optarg, 45);
-			break;
-		case 'u': // scroll mode
-			a =  atoi(optarg);
-			if( (a < 0) || (a > SCROLL_DOWN) )
-				{
-				print_usage();
+	case ACCENT_CEDILLA:
+		if(first > 0) memmove(font_row, base + 1, MATRIX_ROWS - 1);
+		else memmove(font_row + drop, base + drop + 1, MATRIX_ROWS - 1 - drop);
+		font_row[MATRIX_ROWS - 1] = glyph_art("..#..");
+		break;
 
-				exit(1);
-				}
-			scroll_mode = a;
-			break;
-		case 'v': // verbose
-			verbose = 1;
-			break;
-		case 'w':// time to wait after 3 lines displayed
-			three_line_delay = atoi(optarg);
-			break;
- 		case 'x': // special effect mode
-			effect_mode = atoi(optarg);
-			break;
-        case -1:
-        	break;
-		case '?':
-			if (isprint(optopt) )
- 				{
- 				fprintf(stderr, "send_music: unknown option `-%c'.\n", optopt);
- 				}
-			else
+	case ACCENT_STROKE:
+		for(r = first; r <= last; r++)
+			{
+			col = 4 - ( ( (r - first) * 4) + ( (last - first) / 2) ) / (last - first);
+			font_row[r] |= 0x40 >> col;
+			}
+		break;
+
+	case ACCENT_FLIP:
+		for(r = 0; r < MATRIX_ROWS; r++)
+			{
+			font_row[r] = 0;
+			for(col = 0; col < 5; col++)
 				{
-				fprintf(stderr, "send_music: unknown option character `\\x%x'.\n", optopt);
+				if(base[MATRIX_ROWS - 1 - r] & (0x40 >> col) ) font_row[r] |= 0x04 << col;
 				}
-			print_usage();
+			}
+		break;
 
-			exit(1);
-			break;
-		default:
-			print_usage();
-			exit(1);
+	default:
+		if(first >= 2)
+			{
+			font_row[0] = glyph_art(accents[g->accent].top);
+			font_row[1] = glyph_art(accents[g->accent].near);
 			break;
-		}/* end switch a */
-	}/* end while getopt() */
+			}
 
+		if(first == 0)
+			{
+			memmove(font_row + 1, base, drop);
+			memcpy(font_row + drop + 1, base + drop + 1, MATRIX_ROWS - 1 - drop);
+			}
+		font_row[0] = glyph_art(accents[g->accent].upper);
+		break;
+	}
 
-/* set I/O directions */
-/*
-Note:
-GPIO 2 and GPIO 3 have 1k8 pull up resistors!!!
+} /* end function glyph_compose */
 
-must use INP_GPIO before we can use OUT_GPIO
-*/
 
-/*
-8-11, 21-24 are output
-no inputs
-*/
 
-// Set GPIO pins 8-11 to output
-for(i = 8; i <= 11; i++)
-	{
-    INP_GPIO(i);
-    OUT_GPIO(i);
-	}
+/* code point to glyph, pages are taken as they are needed */
+void glyph_map(uint32_t unicode, int code)
+{
+uint8_t **page;
 
-// Set GPIO pins 22-24 to output
-for(i = 21; i <= 24; i++)
+page = &glyph_page[unicode >> 8];
+if(!*page)
 	{
-    INP_GPIO(i);
-    OUT_GPIO(i);
+	if(glyph_pages_used == GLYPH_PAGES) return;
+	*page = glyph_pages[glyph_pages_used++];
 	}
 
+(*page)[unicode & 0xff] = code;
+
+} /* end function glyph_map */
+
+
+
+/* the glyph of a code point, -1 if there is none */
+int glyph_code(uint32_t unicode)
+{
+uint8_t *page;
+
+if(unicode < 128) return unicode;
+if(unicode > 0xffff) return -1;
+
+page = glyph_page[unicode >> 8];
+if(!page || !page[unicode & 0xff]) return -1;
+
+return page[unicode & 0xff];
+} /* end function glyph_code */
 
-// clock and data line low
-sck_l();
-so_l();
 
 
 /*
-MATRIX_SHIFT_REGISTER_CLOCK
-MATRIX_SHIFT_REGISTER_DATA
-MATRIX_STROBE
-MATRIX_ROW_SELECT_A
-MATRIX_ROW_SELECT_B
-MATRIX_ROW_SELECT_C
+UTF-8.
+utf8_codepoint() decodes the sequence at s, n bytes of it available, and sets *len to the bytes it takes.
+Overlong forms, surrogates, code points above 0x10ffff and stray continuation bytes are not characters, the
+longest part of a broken sequence that could have been valid is skipped and read as U+FFFD, so it shows
+as a single GLYPH_UNKNOWN and no byte of it ever reaches a renderer. UTF8_MORE is a sequence cut off
+by the end of the input so far, input that is not UTF-8 at all (Latin-1) shows a '?' for every accent.
 */
+#define UTF8_MORE				-1
+#define UTF8_REPLACEMENT		0xfffd
 
 
-//#define IO_TEST
-#ifdef IO_TEST
-//a = MATRIX_SHIFT_REGISTER_CLOCK;
-//a = MATRIX_SHIFT_REGISTER_DATA;
-//a = MATRIX_STROBE;
-//a = MATRIX_ROW_SELECT_A;
-//a = MATRIX_ROW_SELECT_B;
-a = MATRIX_ROW_SELECT_C;
 
-while(1)
+int utf8_codepoint(unsigned char *s, int n, int *len)
+{
+int i, need;
+uint32_t unicode;
+unsigned char low, high;
+
+*len = 1;
+if(s[0] < 0x80) return s[0];
+if( (s[0] < 0xc2) || (s[0] > 0xf4) ) return UTF8_REPLACEMENT;
+
+// the second byte range excludes overlong forms, surrogates and beyond 0x10ffff
+low = 0x80;
+high = 0xbf;
+if(s[0] < 0xe0)
 	{
-	*(gpio + 7) = a;
-	usleep(100);
-	*(gpio + 10) = a;
-	usleep(100);
+	need = 1;
+	unicode = s[0] & 0x1f;
+	}
+else if(s[0] < 0xf0)
+	{
+	need = 2;
+	unicode = s[0] & 0x0f;
+	if(s[0] == 0xe0) low = 0xa0;
+	if(s[0] == 0xed) high = 0x9f;
+	}
+else
+	{
+	need = 3;
+	unicode = s[0] & 0x07;
+	if(s[0] == 0xf0) low = 0x90;
+	if(s[0] == 0xf4) high = 0x8f;
 	}
-#endif // IO_TEST
 
+for(i = 1; i <= need; i++)
+	{
+	if(i == n) return UTF8_MORE;
 
-time_t now;
-time_t previous_file_read;
-struct tm *local_time;
-char temp[1024];
+	if( (s[i] < low) || (s[i] > high) )
+		{
+		*len = i;
+		return UTF8_REPLACEMENT;
+		}
 
-// Make sure the environments locale is used
-setlocale(LC_TIME, "");
+	unicode = (unicode << 6) | (s[i] & 0x3f);
+	low = 0x80;
+	high = 0xbf;
+	}
 
-// Make sure the file gets read directly (when the file_flag is set)
-previous_file_read = time(0) - file_read_frequency - 1;
+*len = need + 1;
 
-loop_counter = 0;
-while(1)
+return unicode;
+} /* end function utf8_codepoint */
+
+
+
+/* the glyph of the character at s, GLYPH_UNKNOWN if there is none, or UTF8_MORE */
+int utf8_glyph(unsigned char *s, int n, int *len)
+{
+int c;
+
+if(s[0] < 0x80)
 	{
-	// add text
-  now = time(0);
-  local_time = localtime(&now);
-  // printf("Now: [%ld]\n", now);
-	if(date_flag)
-		{
-		strftime(temp, 511, "  %d %m %Y      %H:%M:%S       %A    ", local_time);
-		strcpy(text, temp);
-
-		}
-
-    if ( file_flag ) {
-      if ( now > ( previous_file_read + file_read_frequency)) {
-        // fprintf(stderr, "Reading file\n");
-        // read file
-        fptr = fopen(filename, "r");
-        if ( fptr )  {
-          // Remove the current text
-          memset(&text[0], 0, sizeof(text));
-          // read until (and strip) the first \n
-          fscanf(fptr, "%[^\n]\n", text);
-          fclose(fptr);
-        } else {
-          fprintf(stderr, "Unable to open the file for reading\n");
-          return 1;
-        }
-        previous_file_read = now;
-      }
-    }
-            // fprintf(stderr, "Text is [%s]\n", text);
-	/*
-	The FDS132 has 3 rows of 18  5x7 matrix displays.
-	This makes horizontal 18 x 5 = 90 bits
-	If we make 6 bit wide and 7 bit high characters, then exactly 15 fit on a 'line',
-	so we get 3 rows of 15 characters.
-	*/
+	*len = 1;
+	return s[0];
+	}
 
-	int row;
-	int bit;
-	int k;
+c = utf8_codepoint(s, n, len);
+if(c == UTF8_MORE) return UTF8_MORE;
 
-	/* process each row in the display */
-	for(row = 0; row < 7; row++) // all rows in display
-		{
+c = glyph_code(c);
 
-		// set row select lines
-		if(row & 1) row_select_a_high();
-		else		row_select_a_low();
+return (c < 0) ? GLYPH_UNKNOWN : c;
+} /* end function utf8_glyph */
 
-		if(row & 2) row_select_b_high();
-		else 		row_select_b_low();
 
-		if(row & 4) row_select_c_high();
-		else		row_select_c_low();
 
+/* len bytes of UTF-8 to at most size - 1 glyphs and a 0, returns the number of glyphs */
+int utf8_text(char *dst, int size, char *src, int len)
+{
+int c, i, n, k;
+
+i = 0;
+for(n = 0; (n < len) && (i < size - 1); n += k)
+	{
+	c = utf8_glyph( (unsigned char *)src + n, len - n, &k);
+
+	// cut off at the end
+	if(c == UTF8_MORE)
+		{
+		c = GLYPH_UNKNOWN;
+		k = len - n;
+		}
 
-		// fix for hardware row counting
-		if(row == 6) r = 0;
-		else r = row + 1;
+	dst[i++] = c;
+	}
 
+dst[i] = 0;
 
-		/* pixels from font to shift registers */
-		for(i = 45; i >= 0; i--) // each charater in the input text
-			{
-			for(k = 2; k < 8; k++) // the bits we use from the font rows
-				{
-				c = text[i];
+return i;
+} /* end function utf8_text */
 
-				// font array boundary
-				if(c > 127) c = 0; // subsitute non ASCII with blanks
 
-				bit = (matrixfont[ (c * MATRIX_CHAR_HEIGHT) + r ] >> k) & 1;
 
-				// set shift register data input
-				if(bit) so_h();
-				else so_l();
+/*
+Glyph rows.
+glyph_row[c][r] is the 6 pixel slice of character c in font row r, leftmost pixel in bit 0, made once
+at startup from matrixfont and the code page. Every byte is an index, so rendering is lookups and ORs.
+A text row is packed 6 pixels at a time into a 64 bit accumulator and stored a word at a time.
+
+render_text() does all 7 rows of the whole text in one pass, 8 characters per block: their 8 glyph rows
+(padded to 8 bytes, one 64 bit load each) are transposed as an 8 x 8 byte matrix into 8 characters per
+font row, then the 6 bit slices of each row are packed into 48 bits with shifts and masks in 16, 32
+and 64 bit lanes, two rows at a time in the NEON or SSE2 registers. Without either render_text() is
+render_text_reference(), the row at a time version, done in 64 bit words the transpose is slower than that.
+45 characters are padded to 6 blocks, 6 x 48 bits is exactly 9 words. The benchmark checks they are bit exact.
+*/
+#define GLYPH_BLOCK				8		/* characters per transpose */
+#define GLYPH_TEXT				( ( (MATRIX_CHARS + GLYPH_BLOCK - 1) / GLYPH_BLOCK) * GLYPH_BLOCK)
 
-				// toggle shift register clock
-				sck_h();
-				sck_l();
+#if (GLYPH_TEXT * FONT_PITCH) != (FB_WORDS * 32)
+#error "the padded text must fill the framebuffer words exactly"
+#endif
 
-				} /* end for all bits in font row */
+#if defined(__ARM_NEON)
+#define GLYPH_SIMD				"neon"
+#elif defined(__SSE2__)
+#define GLYPH_SIMD				"sse2"
+#endif
 
-			} /* end for all characters in text string */
+uint8_t glyph_row[256][8] __attribute__( (aligned(8) ) );	/* row 7 is 0 */
 
 
-		/* latch shift register data to output */
 
-		// strobe high
-		strobe_h();
+void glyph_init()
+{
+int c, r, k;
+uint32_t slice;
+unsigned char font_row[256][MATRIX_ROWS];
+struct code_page_glyph *g;
 
-		// strobe low
-		strobe_l();
+// ASCII from matrixfont, the code page made from it, what has no glyph is blank
+memset(font_row, 0, sizeof(font_row) );
+memcpy(font_row, matrixfont, 128 * MATRIX_CHAR_HEIGHT);
 
-		} /* end for all rows */
+memset(glyph_page, 0, sizeof(glyph_page) );
+memset(glyph_pages, 0, sizeof(glyph_pages) );
+glyph_pages_used = 0;
 
-	loop_counter++;
+for(g = code_page; g->unicode; g++)
+	{
+	if(g->code >= 128) glyph_compose(font_row[g->code], g);
+	glyph_map(g->unicode, g->code);
+	}
 
-	/* start special effects */
-	if(effect_mode == EFFECT_FIREWORKS)
+for(c = 0; c < 256; c++)
+	{
+	for(r = 0; r < MATRIX_ROWS; r++)
 		{
-		if(loop_counter == scroll_delay)
+		slice = 0;
+		for(k = 7; k > 1; k--) // font bit 7 is the leftmost pixel
 			{
-			loop_counter = 0;
+			slice |= ( (font_row[c][r] >> k) & 1) << (7 - k);
+			}
 
-			/* create a landscape on the bottom line */
-			for(j = 0; j < 15; j++)
-				{
-				text[j + 30] = fireworks_landscape[j];
-				}
+		glyph_row[c][r] = slice;
+		}
+	}
 
-			input_line_cnt++;
-			if(input_line_cnt == 1)
-				{
-				/* generate sparse random '|' on line 2 */
-				for(j = 0; j < 15; j++)
-					{
-					fa =  random();
-
-					if(fa > (RAND_MAX / 16) )
-						text[j + 15] = ' ';
-					else
-						text[j + 15] = 4;
-					}
-				}
-			else if(input_line_cnt == 2)
-				{
-				/* copy up line and replace '|' code 4 by '*' */
-				for(j = 0; j < 15; j++)
-					{
-					if(text[j + 15] == 4)
-						{
-						text[j] = '*';
-						}
-					else
-						{
-						text[j] = ' ';
-						}
-
-					/* clear second line */
-					text[j + 15] = 0;
-					}
-
-				input_line_cnt = 0;
-				}
+} /* end function glyph_init */
 
-			}
 
-		continue;
 
-		} /* end if EFFECT_FIREWORKS */
-	else if(effect_mode == EFFECT_SNOW)
+/* font row r of n characters to a packed row from pixel 0, every word up to the last pixel is written */
+void glyph_pack(uint32_t *row, unsigned char *s, int n, int r)
+{
+int i, bits;
+uint64_t acc;
+
+acc = 0;
+bits = 0;
+for(i = 0; i < n; i++)
+	{
+	acc |= (uint64_t)glyph_row[s[i] ][r] << bits;
+	bits += FONT_PITCH;
+
+	if(bits >= 32)
+		{
+		*row++ = (uint32_t)acc;
+		acc >>= 32;
+		bits -= 32;
+		}
+	}
+
+if(bits) *row = (uint32_t)acc;
+
+} /* end function glyph_pack */
+
+
+
+#if defined(__ARM_NEON)
+/* the 6 bit slices in the bytes of two rows to 48 bits each */
+static inline uint64x2_t glyph_pack_neon(uint8x8_t lo, uint8x8_t hi)
+{
+uint16x8_t x16;
+uint32x4_t x32;
+uint64x2_t x64;
+
+x16 = vreinterpretq_u16_u8(vcombine_u8(lo, hi) );
+x16 = vorrq_u16(vandq_u16(x16, vdupq_n_u16(0x00ff) ), vshrq_n_u16(vandq_u16(x16, vdupq_n_u16(0xff00) ), 2) );
+
+x32 = vreinterpretq_u32_u16(x16);
+x32 = vorrq_u32(vandq_u32(x32, vdupq_n_u32(0x0000ffff) ), vshrq_n_u32(vandq_u32(x32, vdupq_n_u32(0xffff0000) ), 4) );
+
+x64 = vreinterpretq_u64_u32(x32);
+x64 = vorrq_u64(vandq_u64(x64, vdupq_n_u64(0x00000000ffffffffULL) ), vshrq_n_u64(vandq_u64(x64, vdupq_n_u64(0xffffffff00000000ULL) ), 8) );
+
+return x64;
+} /* end function glyph_pack_neon */
+
+
+
+/* 8 characters, font row r of them as 48 packed bits in packed[r] */
+void glyph_block_simd(uint64_t *packed, unsigned char *s)
+{
+uint8x8x2_t t0, t1, t2, t3;
+uint16x4x2_t u0, u1, u2, u3;
+uint32x2x2_t v0, v1, v2, v3;
+
+// transpose, vtrn swaps the off diagonal 1 x 1, 2 x 2 and 4 x 4 blocks
+t0 = vtrn_u8(vld1_u8(glyph_row[s[0] ]), vld1_u8(glyph_row[s[1] ]) );
+t1 = vtrn_u8(vld1_u8(glyph_row[s[2] ]), vld1_u8(glyph_row[s[3] ]) );
+t2 = vtrn_u8(vld1_u8(glyph_row[s[4] ]), vld1_u8(glyph_row[s[5] ]) );
+t3 = vtrn_u8(vld1_u8(glyph_row[s[6] ]), vld1_u8(glyph_row[s[7] ]) );
+
+u0 = vtrn_u16(vreinterpret_u16_u8(t0.val[0]), vreinterpret_u16_u8(t1.val[0]) );
+u1 = vtrn_u16(vreinterpret_u16_u8(t0.val[1]), vreinterpret_u16_u8(t1.val[1]) );
+u2 = vtrn_u16(vreinterpret_u16_u8(t2.val[0]), vreinterpret_u16_u8(t3.val[0]) );
+u3 = vtrn_u16(vreinterpret_u16_u8(t2.val[1]), vreinterpret_u16_u8(t3.val[1]) );
+
+v0 = vtrn_u32(vreinterpret_u32_u16(u0.val[0]), vreinterpret_u32_u16(u2.val[0]) );	/* rows 0 and 4 */
+v1 = vtrn_u32(vreinterpret_u32_u16(u1.val[0]), vreinterpret_u32_u16(u3.val[0]) );	/* rows 1 and 5 */
+v2 = vtrn_u32(vreinterpret_u32_u16(u0.val[1]), vreinterpret_u32_u16(u2.val[1]) );	/* rows 2 and 6 */
+v3 = vtrn_u32(vreinterpret_u32_u16(u1.val[1]), vreinterpret_u32_u16(u3.val[1]) );	/* rows 3 and 7 */
+
+vst1q_u64(&packed[0], glyph_pack_neon(vreinterpret_u8_u32(v0.val[0]), vreinterpret_u8_u32(v1.val[0]) ) );
+vst1q_u64(&packed[2], glyph_pack_neon(vreinterpret_u8_u32(v2.val[0]), vreinterpret_u8_u32(v3.val[0]) ) );
+vst1q_u64(&packed[4], glyph_pack_neon(vreinterpret_u8_u32(v0.val[1]), vreinterpret_u8_u32(v1.val[1]) ) );
+vst1q_u64(&packed[6], glyph_pack_neon(vreinterpret_u8_u32(v2.val[1]), vreinterpret_u8_u32(v3.val[1]) ) );
+
+} /* end function glyph_block_simd */
+#elif defined(__SSE2__)
+/* the 6 bit slices in the bytes of two rows to 48 bits each */
+static inline __m128i glyph_pack_sse2(__m128i x)
+{
+x = _mm_or_si128(_mm_and_si128(x, _mm_set1_epi16(0x00ff) ), _mm_srli_epi16(_mm_and_si128(x, _mm_set1_epi16( (short)0xff00) ), 2) );
+x = _mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(0x0000ffff) ), _mm_srli_epi32(_mm_and_si128(x, _mm_set1_epi32( (int)0xffff0000) ), 4) );
+x = _mm_or_si128(_mm_and_si128(x, _mm_set1_epi64x(0x00000000ffffffffLL) ), _mm_srli_epi64(_mm_and_si128(x, _mm_set1_epi64x( (long long)0xffffffff00000000ULL) ), 8) );
+
+return x;
+} /* end function glyph_pack_sse2 */
+
+
+
+/* 8 characters, font row r of them as 48 packed bits in packed[r] */
+void glyph_block_simd(uint64_t *packed, unsigned char *s)
+{
+__m128i b0, b1, b2, b3, c0, c1, c2, c3;
+
+// transpose, interleave bytes, then pairs, then 4 characters of the same row
+b0 = _mm_unpacklo_epi8(_mm_loadl_epi64( (__m128i *)glyph_row[s[0] ]), _mm_loadl_epi64( (__m128i *)glyph_row[s[1] ]) );
+b1 = _mm_unpacklo_epi8(_mm_loadl_epi64( (__m128i *)glyph_row[s[2] ]), _mm_loadl_epi64( (__m128i *)glyph_row[s[3] ]) );
+b2 = _mm_unpacklo_epi8(_mm_loadl_epi64( (__m128i *)glyph_row[s[4] ]), _mm_loadl_epi64( (__m128i *)glyph_row[s[5] ]) );
+b3 = _mm_unpacklo_epi8(_mm_loadl_epi64( (__m128i *)glyph_row[s[6] ]), _mm_loadl_epi64( (__m128i *)glyph_row[s[7] ]) );
+
+c0 = _mm_unpacklo_epi16(b0, b1);	/* rows 0 to 3 of characters 0 to 3 */
+c1 = _mm_unpackhi_epi16(b0, b1);	/* rows 4 to 7 */
+c2 = _mm_unpacklo_epi16(b2, b3);	/* rows 0 to 3 of characters 4 to 7 */
+c3 = _mm_unpackhi_epi16(b2, b3);
+
+_mm_storeu_si128( (__m128i *)&packed[0], glyph_pack_sse2(_mm_unpacklo_epi32(c0, c2) ) );
+_mm_storeu_si128( (__m128i *)&packed[2], glyph_pack_sse2(_mm_unpackhi_epi32(c0, c2) ) );
+_mm_storeu_si128( (__m128i *)&packed[4], glyph_pack_sse2(_mm_unpacklo_epi32(c1, c3) ) );
+_mm_storeu_si128( (__m128i *)&packed[6], glyph_pack_sse2(_mm_unpackhi_epi32(c1, c3) ) );
+
+} /* end function glyph_block_simd */
+#endif
+
+
+
+#ifdef GLYPH_SIMD
+/* all rows of the text, 8 characters at a time */
+void render_text_simd(uint32_t fb[MATRIX_ROWS][FB_WORDS], char *s)
+{
+int i, r, w, bits;
+unsigned char padded[GLYPH_TEXT];
+uint64_t packed[8], acc[MATRIX_ROWS];
+
+memcpy(padded, s, MATRIX_CHARS);
+memset(padded + MATRIX_CHARS, 0, GLYPH_TEXT - MATRIX_CHARS);
+
+memset(acc, 0, sizeof(acc) );
+bits = 0;
+w = 0;
+for(i = 0; i < GLYPH_TEXT; i += GLYPH_BLOCK)
+	{
+	glyph_block_simd(packed, padded + i);
+
+	// 48 bits on 0 or 16 bits left over, never more than 64
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		acc[r] |= packed[r] << bits;
+		}
+	bits += GLYPH_BLOCK * FONT_PITCH;
+
+	while(bits >= 32)
 		{
-		/* create a landscape on the bottom line */
-		for(j = 0; j < 15; j++)
+		for(r = 0; r < MATRIX_ROWS; r++)
 			{
-			text[j + 30] = snow_landscape[j];
+			fb[r][w] = (uint32_t)acc[r];
+			acc[r] >>= 32;
 			}
+		w++;
+		bits -= 32;
+		}
+	}
 
-		if(loop_counter == scroll_delay)
-			{
-			loop_counter = 0;
+} /* end function render_text_simd */
+#endif
 
-			/* copy down topline */
-			for(j = 0; j < 15; j++)
-				{
-				text[j + 15] = text[j];
 
-				/* clear to line */
-				text[j] = ' ';
-				}
 
-			/* generate random snow on top line */
-			for(j = 0; j < 15; j++)
-				{
-				fa =  random();
+/* write the n lowest bits of bits to a packed row at pixel p */
+void put_bits(uint32_t *row, int p, uint32_t bits, int n)
+{
+int w, s;
+uint32_t mask;
+
+w = p >> 5;
+s = p & 31;
+
+if(n == 32) mask = 0xffffffff;
+else mask = (1u << n) - 1;
+
+bits &= mask;
+
+row[w] = (row[w] & ~(mask << s) ) | (bits << s);
+
+// straddles a word boundary
+if(s + n > 32)
+	{
+	row[w + 1] = (row[w + 1] & ~(mask >> (32 - s) ) ) | (bits >> (32 - s) );
+	}
+
+} /* end function put_bits */
+
+
+
+void render_char(uint32_t fb[MATRIX_ROWS][FB_WORDS], int cell, int c)
+{
+int r;
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	put_bits(fb[r], cell * FONT_PITCH, glyph_row[c & 255][r], FONT_PITCH);
+	}
+
+} /* end function render_char */
+
+
+
+void render_text_reference(uint32_t fb[MATRIX_ROWS][FB_WORDS], char *s)
+{
+int r;
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	glyph_pack(fb[r], (unsigned char *)s, MATRIX_CHARS, r);
+	}
+
+} /* end function render_text_reference */
 
-				if(fa > (RAND_MAX / 2) )
-					text[j]  = ' ';
-				else
-					text[j] = '*';
-				}
 
+
+void render_text(uint32_t fb[MATRIX_ROWS][FB_WORDS], char *s)
+{
+#ifdef GLYPH_SIMD
+render_text_simd(fb, s);
+#else
+render_text_reference(fb, s);
+#endif
+
+} /* end function render_text */
+
+
+
+/*
+Fonts.
+-F loads a font for proportional text: every character is as wide as its glyph, 18 to 20 fit on a line
+instead of 15. BDF fonts keep their own advance widths, fixed width PSF fonts and -F builtin (matrixfont)
+are trimmed to their ink plus one pixel, a blank glyph is half a cell wide.
+A character the font does not define, the ? included, is taken from the built in font, trimmed the same way.
+A font is compiled into an atlas, 256 glyphs of 7 rows of at most 16 pixels and a width, 4 kB.
+-F font,atlas writes the atlas once and maps it on later starts, as long as it is newer than the font,
+an atlas file can also be given on its own.
+Fonts are 7 rows high, of an 8 row font the emptier of the top and bottom row is dropped.
+The text flows over the 3 lines, a line ends where the next character does not fit or at a \n.
+Effects stay on the 15 x 3 grid of the built in font.
+*/
+#define FONT_WIDTH_MAX			16
+#define FONT_HEIGHT_MAX			(MATRIX_ROWS + 1)
+#define FONT_ATLAS_MAGIC		"FDS132A3"		/* A3, glyphs a font lacks are the built in ones */
+
+struct font_glyph
+	{
+	uint16_t row[MATRIX_ROWS];		/* leftmost pixel in bit 0 */
+	uint8_t width;					/* advance in pixels */
+	uint8_t pad;
+	};
+
+struct font_atlas
+	{
+	char magic[8];
+	uint32_t glyphs;				/* 256 */
+	uint32_t size;					/* of the atlas */
+	struct font_glyph glyph[256];
+	};
+
+/* what a font file gives, before it is fitted to the panel */
+struct font_source
+	{
+	int height;						/* rows used in row[] */
+	int cell;						/* width of a fixed width font, trimmed to its ink, 0 is proportional */
+	int width[256];
+	uint16_t row[256][FONT_HEIGHT_MAX];
+	uint8_t has[256];				/* the font defines the glyph, else it is the built in one */
+	};
+
+struct font_atlas *font;			/* NULL is the 6 pixel grid */
+char *font_name;
+
+
+
+/* a glyph of a fixed width font to its ink and a pixel, a blank one is half a cell */
+void font_trim(struct font_glyph *g, int cell)
+{
+int r, lead, last;
+uint32_t ink;
+
+ink = 0;
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	ink |= g->row[r];
+	}
+
+if(!ink)
+	{
+	g->width = (cell + 1) / 2;
+	return;
+	}
+
+lead = __builtin_ctz(ink);
+last = 31 - __builtin_clz(ink);
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	g->row[r] >>= lead;
+	}
+g->width = last - lead + 2;
+
+} /* end function font_trim */
+
+
+
+/* fit a font source to 7 rows and trim fixed widths, to atlas */
+void font_compile(struct font_source *src, struct font_atlas *atlas)
+{
+int c, r, top;
+uint32_t edge[2];
+
+memset(atlas, 0, sizeof(struct font_atlas) );
+memcpy(atlas->magic, FONT_ATLAS_MAGIC, 8);
+atlas->glyphs = 256;
+atlas->size = sizeof(struct font_atlas);
+
+// 8 rows, drop the one with less ink in the printable characters
+top = 0;
+if(src->height > MATRIX_ROWS)
+	{
+	edge[0] = 0;
+	edge[1] = 0;
+	for(c = 32; c < 127; c++)
+		{
+		edge[0] += __builtin_popcount(src->row[c][0]);
+		edge[1] += __builtin_popcount(src->row[c][MATRIX_ROWS]);
+		}
+
+	if(edge[0] < edge[1]) top = 1;
+	}
+
+for(c = 0; c < 256; c++)
+	{
+	// a character the font does not have, above all the ? for what can not be shown, must not vanish
+	if(!src->has[c])
+		{
+		for(r = 0; r < MATRIX_ROWS; r++)
+			{
+			atlas->glyph[c].row[r] = glyph_row[c][r];
 			}
 
+		font_trim(&atlas->glyph[c], FONT_PITCH);
 		continue;
-		} /* end if EFFECT_SNOW */
+		}
+
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		atlas->glyph[c].row[r] = src->row[c][r + top];
+		}
 
-	/* end special effects */
+	atlas->glyph[c].width = src->width[c];
+	if(src->cell) font_trim(&atlas->glyph[c], src->cell);
+	}
+
+} /* end function font_compile */
 
 
-	if(date_flag) continue;
-	if(text_flag) continue;
-  if(file_flag) continue;
 
-	// when time process any scrolling, v or h
+/* matrixfont, trimmed */
+void font_builtin(struct font_source *src)
+{
+int c, r;
+
+src->height = MATRIX_ROWS;
+src->cell = FONT_PITCH;
 
-	// after line 3 wait longer
-	if(line_cnt == 3)
+for(c = 0; c < 256; c++)
+	{
+	for(r = 0; r < MATRIX_ROWS; r++)
 		{
-		a = scroll_delay + three_line_delay;
+		src->row[c][r] = glyph_row[c][r];
 		}
-	else  a = scroll_delay;
+	src->has[c] = 1;
+	}
+
+} /* end function font_builtin */
+
 
-	if(loop_counter == a)
+
+/* BDF, the glyphs of the code page by ENCODING, returns -1 on an error */
+int font_bdf(FILE *fptr, struct font_source *src)
+{
+int i, j, col, row, bits;
+int ascent, descent, code, dwidth;
+int bbx_w, bbx_h, bbx_x, bbx_y;
+unsigned long value;
+char line[256];
+
+ascent = -1;
+descent = -1;
+bbx_w = 0;
+bbx_h = 0;
+bbx_x = 0;
+bbx_y = 0;
+code = -1;
+dwidth = -1;
+
+while(fgets(line, sizeof(line), fptr) )
+	{
+	if(sscanf(line, "FONT_ASCENT %d", &ascent) == 1) continue;
+	if(sscanf(line, "FONT_DESCENT %d", &descent) == 1) continue;
+
+	// the font bounding box if there are no FONT_ASCENT and FONT_DESCENT
+	if(sscanf(line, "FONTBOUNDINGBOX %d %d %d %d", &bbx_w, &bbx_h, &bbx_x, &bbx_y) == 4)
 		{
-		loop_counter = 0;
+		if(ascent < 0) ascent = bbx_h + bbx_y;
+		if(descent < 0) descent = -bbx_y;
+		continue;
+		}
 
-		if(scroll_mode == SCROLL_UP) // vertical scroll up
-			{
-			/* copy up one line, make space */
-			for(i = 0; i < 30; i++)
-				{
-				text[i] = text[i + 15];
-				}
+	if(strncmp(line, "STARTCHAR", 9) == 0)
+		{
+		code = -1;
+		dwidth = -1;
+		continue;
+		}
 
-			/* read in new bottom line */
-			// clear line in case input does not fill a line (EOF)
-			for(i = 30 ; i < 45; i++)
-				{
-				text[i] = 0;
-				}
+	// Unicode, to the glyph that shows it
+	if(sscanf(line, "ENCODING %d", &code) == 1)
+		{
+		if(code >= 0) code = glyph_code(code);
+		continue;
+		}
+	if(sscanf(line, "DWIDTH %d", &dwidth) == 1) continue;
+	if(sscanf(line, "BBX %d %d %d %d", &bbx_w, &bbx_h, &bbx_x, &bbx_y) == 4) continue;
 
-			if(line_cnt == 3) line_cnt = 0;
-			line_cnt++;
+	if(strncmp(line, "BITMAP", 6) != 0) continue;
 
-			// get characters from input to bottom line
-			i = 0;
-			while(1)
-				{
-				c = fgetc(stdin);
-				if(feof(stdin) )
-					{
-					if(exit_on_eof_flag)
-						{
-						exit(0);
-						}
-					else
-						{
-						text_flag = 1;
-
-						break;
-						}
-					}
-
-				if(c == 10) // LF, line feed
-					{
-					break;
-					}
-
-				if(c == 12) // FF, form feed
-					{
-					// start again at top
-					i = 0;
-					line_cnt = 0;
-
-					// clear screen
-					for(j = 0; j < 45; j++)
-						{
-						text[j] = ' ';
-						}
-
-					break;
-					}
-
-				if( (c != 10)  && (c != 13) ) // skip any LF, CR
-					{
-					// font array boundary, skip non ASCII
-					if(c > 127) c = 0;
-
-					text[30 + i] = c;
-					i++;
-					if(i == 15) break;
-					}
+	src->height = ascent + descent;
+	if( (ascent < 0) || (descent < 0) || (src->height > FONT_HEIGHT_MAX) )
+		{
+		fprintf(stderr, "font is %d pixels high, at most %d\n", src->height, FONT_HEIGHT_MAX);
+		return -1;
+		}
 
-				}
+	// rows of hex digits, leftmost pixel in the most significant bit, the glyph box sits on the baseline
+	for(i = 0; i < bbx_h; i++)
+		{
+		if(!fgets(line, sizeof(line), fptr) ) return -1;
 
-			text[45] = 0;
+		// the leftmost 32 pixels are more than enough
+		bits = strspn(line, "0123456789abcdefABCDEF") * 4;
+		if(bits > 32)
+			{
+			line[8] = 0;
+			bits = 32;
+			}
+		value = strtoul(line, NULL, 16);
 
-			// line feed
-			if(c == 10) continue;
+		row = ascent - (bbx_y + bbx_h) + i;
+		if( (code < 0) || (code > 255) || (row < 0) || (row >= src->height) ) continue;
 
-			} /* end if scroll up */
-		else if(scroll_mode == SCROLL_DOWN)
+		for(j = 0; (j < bbx_w) && (j < bits); j++)
 			{
+			col = bbx_x + j;
+			if( (col < 0) || (col >= FONT_WIDTH_MAX) ) continue;
 
-			/* copy down one line, make space */
+			if( (value >> (bits - 1 - j) ) & 1) src->row[code][row] |= 1 << col;
+			}
+		}
 
-if(verbose)
-	fprintf(stderr, "WAS A input_line_cnt=%d text=%s\n", input_line_cnt, text);
-			for(i = 0; i < 30 ; i++)
-				{
-				text[44 - i ] = text[29 - i];
-				}
+	if( (code >= 0) && (code <= 255) )
+		{
+		if(dwidth < 0) dwidth = bbx_x + bbx_w;
+		if(dwidth > FONT_WIDTH_MAX) dwidth = FONT_WIDTH_MAX;
+		if(dwidth < 0) dwidth = 0;
 
-if(verbose)
-	fprintf(stderr, "WAS B input_line_cnt=%d text=%s\n", input_line_cnt, text);
+		src->width[code] = dwidth;
+		src->has[code] = 1;
+		}
+	}
 
-			/* read in new top line */
+if(src->height <= 0)
+	{
+	fprintf(stderr, "no glyphs in the font\n");
+	return -1;
+	}
 
-			// clear line in case input does not fill a line (EOF)
-			for(i = 0 ; i < 15; i++)
-				{
-				text[i] = 0;
-				}
+return 0;
+} /* end function font_bdf */
 
-			if(line_cnt == 3) line_cnt = 0;
-			line_cnt++;
 
-			// get characters from input to bottom line
-			i = 0;
-			while(1)
-				{
-				c = fgetc(stdin);
-				if(feof(stdin) )
-					{
-					if(exit_on_eof_flag)
-						{
-						exit(0);
-						}
-					else
-						{
-						text_flag = 1;
-
-						break;
-						}
-					}
-
-				if(c == 10) // LF, line feed
-					{
-					break;
-					}
-
-				if(c == 12) // FF, form feed
-					{
-					// start again at bottom
-					i = 0;
-					line_cnt = 0;
-
-					// clear screen
-					for(j = 0; j < 45; j++)
-						{
-						text[j] = ' ';
-						}
-
-					break;
-					}
-
-				if( (c != 10)  && (c != 13) ) // skip any LF, CR
-					{
-					// font array boundary, skip non ASCII
-					if(c > 127) c = 0;
-
-					text[i] = c;
-					i++;
-					if(i == 15) break;
-					}
 
-				}
+/* PSF 1 or 2, by the unicode table if there is one, else glyph n is character n */
+int font_psf(unsigned char *data, size_t size, struct font_source *src)
+{
+int i, j, r, glyphs, height, width, stride, len;
+uint32_t header_size, flags, glyph_size;
+int code;
+unsigned char *glyph, *table, *end;
 
-			text[45] = 0;
+if( (size >= 4) && (data[0] == 0x36) && (data[1] == 0x04) )
+	{
+	glyphs = (data[2] & 1) ? 512 : 256;
+	height = data[3];
+	width = 8;
+	header_size = 4;
+	glyph_size = height;
+	flags = data[2] & 2;
+	}
+else if( (size >= 32) && (data[0] == 0x72) && (data[1] == 0xb5) && (data[2] == 0x4a) && (data[3] == 0x86) )
+	{
+	memcpy(&header_size, data + 8, 4);
+	memcpy(&flags, data + 12, 4);
+	memcpy(&glyphs, data + 16, 4);
+	memcpy(&glyph_size, data + 20, 4);
+	memcpy(&height, data + 24, 4);
+	memcpy(&width, data + 28, 4);
+	flags &= 1;
+	}
+else return -1;
+
+if( (height > FONT_HEIGHT_MAX) || (width > FONT_WIDTH_MAX) )
+	{
+	fprintf(stderr, "font is %d x %d pixels, at most %d x %d\n", width, height, FONT_WIDTH_MAX, FONT_HEIGHT_MAX);
+	return -1;
+	}
+
+// a glyph must hold its rows and the glyphs must be in the file, also for a 32 bit size_t
+stride = (width + 7) / 8;
+if( (glyphs <= 0) || (height <= 0) || (width <= 0) || ( (data[0] == 0x72) && (header_size < 32) ) || (header_size > size) ||
+ (glyph_size < (uint32_t)(stride * height) ) || ( (size - header_size) / glyph_size < (size_t)glyphs) )
+	{
+	fprintf(stderr, "font file is damaged\n");
+	return -1;
+	}
+
+src->height = height;
+src->cell = width;
+
+table = data + header_size + (glyphs * glyph_size);
+end = data + size;
 
-			// line feed
-			if(c == 10) continue;
+for(i = 0; i < glyphs; i++)
+	{
+	glyph = data + header_size + (i * glyph_size);
 
-			} /* end if scroll down */
-		else if(scroll_mode == SCROLL_LEFT)
+	for(r = 0; r < height; r++)
+		{
+		code = 0;
+		for(j = 0; j < width; j++)
 			{
-			// get new character from input
-			c = fgetc(stdin);
-			if(feof(stdin) )
-				{
-				if(exit_on_eof_flag)
-					{
-					exit(0);
-					}
-				else
-					{
-					text_flag = 1;
-
-					continue;
-					}
-				}
+			if(glyph[(r * stride) + (j >> 3)] & (0x80 >> (j & 7) ) ) code |= 1 << j;
+			}
 
-			// font array boundary, replace non ASCII with blanks
-			if(c > 127) c = 0;
+		if(flags) continue;
+		if(i < 256) src->row[i][r] = code;
+		}
 
-			text[45] = c;
+	if(!flags)
+		{
+		if(i < 256) src->has[i] = 1;
+		continue;
+		}
 
-			// copy down text array
-			for(i = 0; i < 45; i++)
+	// PSF 1 entries are 16 bit, PSF 2 UTF-8, both end with 0xffff or 0xff, a 0xfffe or 0xfe sequence is skipped
+	while(table < end)
+		{
+		if(data[0] == 0x36)
+			{
+			if(table + 2 > end) break;
+			code = table[0] | (table[1] << 8);
+			table += 2;
+			if(code == 0xffff) break;
+			if(code == 0xfffe) continue;
+			}
+		else
+			{
+			if(*table == 0xff)
+				{
+				table++;
+				break;
+				}
+			if(*table == 0xfe)
 				{
-				text[i] = text[i + 1];
+				table++;
+				continue;
 				}
 
-			text[46] = 0;
-			} /* end if scroll left */
+			code = utf8_codepoint(table, end - table, &len);
+			table += (code == UTF8_MORE) ? end - table : len;
+			}
 
-		} /* end while scan */
-	} /* end if loop_counter == scroll_delay */
+		code = glyph_code(code);
+		if( (code < 0) || (code > 255) ) continue;
 
-	// end v, h scroll processing
+		src->has[code] = 1;
+		for(r = 0; r < height; r++)
+			{
+			src->row[code][r] = 0;
+			for(j = 0; j < width; j++)
+				{
+				if(glyph[(r * stride) + (j >> 3)] & (0x80 >> (j & 7) ) ) src->row[code][r] |= 1 << j;
+				}
+			}
+		}
+	}
+
+return 0;
+} /* end function font_psf */
+
+
+
+/* an atlas written earlier, mapped read only */
+struct font_atlas *font_map(char *path)
+{
+int fd;
+struct stat st;
+struct font_atlas *atlas;
+
+fd = open(path, O_RDONLY | O_CLOEXEC);
+if(fd < 0) return NULL;
+
+atlas = NULL;
+if( (fstat(fd, &st) == 0) && (st.st_size == sizeof(struct font_atlas) ) )
+	{
+	atlas = mmap(NULL, sizeof(struct font_atlas), PROT_READ, MAP_SHARED, fd, 0);
+	if(atlas == MAP_FAILED) atlas = NULL;
+	}
+close(fd);
+
+if(atlas && ( (memcmp(atlas->magic, FONT_ATLAS_MAGIC, 8) != 0) || (atlas->glyphs != 256) || (atlas->size != sizeof(struct font_atlas) ) ) )
+	{
+	munmap(atlas, sizeof(struct font_atlas) );
+	atlas = NULL;
+	}
+
+return atlas;
+} /* end function font_map */
+
+
+
+/* other instances may have the atlas mapped, a new one is renamed over it, never truncated */
+void font_save(char *atlas_path)
+{
+int fd, ok;
+char *temp;
+
+temp = malloc(strlen(atlas_path) + 8);
+if(!temp) return;
+sprintf(temp, "%s.XXXXXX", atlas_path);
+
+fd = mkostemp(temp, O_CLOEXEC);
+ok = (fd >= 0) && (fchmod(fd, 0644) == 0) && (write(fd, font, sizeof(struct font_atlas) ) == sizeof(struct font_atlas) );
+if(fd >= 0) ok &= (close(fd) == 0);
+
+if(ok) ok = (rename(temp, atlas_path) == 0);
+
+if(!ok)
+	{
+	fprintf(stderr, "can't write font atlas %s: %s\n", atlas_path, strerror(errno) );
+	if(fd >= 0) unlink(temp);
+	}
+
+free(temp);
+
+} /* end function font_save */
+
+
+
+/* font[,atlas], exits on an error */
+void font_load(char *arg)
+{
+FILE *fptr;
+char *path, *atlas_path;
+struct stat font_stat, atlas_stat;
+struct font_source *src;
+unsigned char *data;
+
+path = strdup(arg);
+atlas_path = strchr(path, ',');
+if(atlas_path) *atlas_path++ = 0;
+
+// the built in font is as old as the program
+if(strcmp(path, "builtin") == 0)
+	{
+	if(stat("/proc/self/exe", &font_stat) < 0) font_stat.st_mtime = time(0);
+	}
+else
+	{
+	if(stat(path, &font_stat) < 0)
+		{
+		fprintf(stderr, "can't open font %s: %s\n", path, strerror(errno) );
+		exit(1);
+		}
+
+	// an atlas on its own
+	font = font_map(path);
+	if(font)
+		{
+		free(path);
+		return;
+		}
+	}
+
+// or one that is newer than the font
+if(atlas_path && (stat(atlas_path, &atlas_stat) == 0) && (atlas_stat.st_mtime >= font_stat.st_mtime) )
+	{
+	font = font_map(atlas_path);
+	if(font)
+		{
+		free(path);
+		return;
+		}
+	}
+
+src = calloc(1, sizeof(struct font_source) );
+font = malloc(sizeof(struct font_atlas) );
+if(!src || !font)
+	{
+	fprintf(stderr, "font_load(): out of memory\n");
+	exit(1);
+	}
+
+if(strcmp(path, "builtin") == 0) font_builtin(src);
+else
+	{
+	fptr = fopen(path, "r");
+	data = malloc(font_stat.st_size + 1);
+	if(!fptr || !data || (fread(data, 1, font_stat.st_size, fptr) != font_stat.st_size) )
+		{
+		fprintf(stderr, "can't read font %s\n", path);
+		exit(1);
+		}
+	rewind(fptr);
+
+	if( (font_psf(data, font_stat.st_size, src) < 0) && ( (memcmp(data, "STARTFONT", 9) != 0) || (font_bdf(fptr, src) < 0) ) )
+		{
+		fprintf(stderr, "%s is not a BDF or PSF font (gunzip a .psf.gz first)\n", path);
+		exit(1);
+		}
+
+	fclose(fptr);
+	free(data);
+	}
+
+font_compile(src, font);
+free(src);
+
+if(atlas_path) font_save(atlas_path);
+
+free(path);
+
+} /* end function font_load */
+
+
+
+/* proportional characters from s while they fit in width pixels, from pixel p of the packed rows, returns how many */
+int font_render(uint32_t **rows, int p, int width, unsigned char *s, int n)
+{
+int i, r, x, w;
+struct font_glyph *g;
+
+x = 0;
+for(i = 0; i < n; i++)
+	{
+	if( (s[i] == 0) || (s[i] == '\n') ) break;
+
+	g = &font->glyph[s[i] ];
+	w = g->width;
+	if(x + w > width) break;
+
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		if(w) put_bits(rows[r], p + x, g->row[r], w);
+		}
+	x += w;
+	}
+
+return i;
+} /* end function font_render */
+
+
+
+/* the text flows over the lines, as much as fits */
+void font_text(uint32_t fb[MATRIX_ROWS][FB_WORDS], char *s, int len)
+{
+int i, r, line;
+uint32_t *rows[MATRIX_ROWS];
+
+memset(fb, 0, sizeof(uint32_t) * MATRIX_ROWS * FB_WORDS);
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	rows[r] = fb[r];
+	}
+
+i = 0;
+for(line = 0; line < MATRIX_LINES; line++)
+	{
+	i += font_render(rows, line * MATRIX_LINE_PIXELS, MATRIX_LINE_PIXELS, (unsigned char *)s + i, len - i);
+
+	if( (i < len) && (s[i] == '\n') ) i++;
+	}
+
+} /* end function font_text */
+
+
+
+/*
+Large glyphs.
+With -L 2 or -L 3 the first text line is drawn 2 or 3 times as high and wide, 14 or the full 21 pixel rows,
+centred, for a clock or a headline that can be read from far away. With -L 2 the rest of the text goes on
+the bottom line at the normal size. Each glyph of the font in use (the built in grid or -F) is scaled once
+at startup into large_glyph[], a bit row per pixel row, so drawing is the same shifts and ORs as a normal line.
+The grid glyphs are trimmed to their ink and a pixel, the digits are all as wide as the widest, so
+HH:MM:SS fits in 84 pixels at -L 2 and the clock does not move as the time changes.
+The pixel rows are folded onto the framebuffer like the vertical canvas: row y is font row y % 7 of line y / 7.
+*/
+#define LARGE_SCALE_MAX			3
+#define LARGE_ROWS				(MATRIX_ROWS * LARGE_SCALE_MAX)
+
+struct large_glyph
+	{
+	uint64_t row[LARGE_ROWS];		/* leftmost pixel in bit 0, FONT_WIDTH_MAX * 3 fits */
+	uint8_t width;
+	};
+
+int large_scale;					/* 0 is off */
+struct large_glyph *large_glyph;	/* 256, NULL if off */
+
+
+
+void large_init()
+{
+int c, r, k, lead, last, digit_width;
+int width[256];
+uint32_t ink, rows[256][MATRIX_ROWS];
+uint64_t scaled;
+
+large_glyph = calloc(256, sizeof(struct large_glyph) );
+if(!large_glyph)
+	{
+	fprintf(stderr, "large_init(): could not allocate the glyphs\n");
+	exit(1);
+	}
+
+// the grid glyphs trimmed to their ink and a pixel like -F builtin, at 2 x 6 pixels HH:MM:SS would not fit
+for(c = 0; c < 256; c++)
+	{
+	ink = 0;
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		rows[c][r] = font ? font->glyph[c].row[r] : glyph_row[c][r];
+		ink |= rows[c][r];
+		}
+
+	width[c] = font ? font->glyph[c].width : FONT_PITCH;
+	if(font) continue;
+
+	if(!ink)
+		{
+		width[c] = (FONT_PITCH + 1) / 2;
+		continue;
+		}
+
+	lead = __builtin_ctz(ink);
+	last = 31 - __builtin_clz(ink);
+
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		rows[c][r] >>= lead;
+		}
+	width[c] = last - lead + 2;
+	}
+
+// digits all as wide as the widest, so the clock does not move as the time changes
+digit_width = 0;
+for(c = '0'; c <= '9'; c++)
+	{
+	if(width[c] > digit_width) digit_width = width[c];
+	}
+
+for(c = '0'; c <= '9'; c++)
+	{
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		rows[c][r] <<= (digit_width - width[c]) / 2;
+		}
+	width[c] = digit_width;
+	}
+
+for(c = 0; c < 256; c++)
+	{
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		// each pixel to large_scale pixels
+		scaled = 0;
+		for(k = 0; k < width[c]; k++)
+			{
+			if( (rows[c][r] >> k) & 1) scaled |= ( (1ull << large_scale) - 1) << (k * large_scale);
+			}
+
+		for(k = 0; k < large_scale; k++)
+			{
+			large_glyph[c].row[(r * large_scale) + k] = scaled;
+			}
+		}
+
+	large_glyph[c].width = width[c] * large_scale;
+	}
+
+} /* end function large_init */
+
+
+
+/* n bits at pixel x of pixel row y of the 90 x 21 panel */
+void large_put(uint32_t fb[MATRIX_ROWS][FB_WORDS], int x, int y, uint64_t bits, int n)
+{
+int p;
+
+p = ( (y / MATRIX_ROWS) * MATRIX_LINE_PIXELS) + x;
+
+if(n > 32)
+	{
+	put_bits(fb[y % MATRIX_ROWS], p, (uint32_t)bits, 32);
+	put_bits(fb[y % MATRIX_ROWS], p + 32, (uint32_t)(bits >> 32), n - 32);
+	}
+else if(n) put_bits(fb[y % MATRIX_ROWS], p, (uint32_t)bits, n);
+
+} /* end function large_put */
+
+
+
+/* how many large characters of the line at s fit, and their width */
+int large_fit(unsigned char *s, int len, int *width)
+{
+int n;
+
+*width = 0;
+for(n = 0; (n < len) && s[n] && (s[n] != '\n'); n++)
+	{
+	if(*width + large_glyph[s[n] ].width > MATRIX_LINE_PIXELS) break;
+	*width += large_glyph[s[n] ].width;
+	}
+
+return n;
+} /* end function large_fit */
+
+
+
+/* the first line large and centred, with -L 2 the next one below it at the normal size */
+void large_text(uint32_t fb[MATRIX_ROWS][FB_WORDS], char *s, int len)
+{
+int i, n, x, y, r, width, line;
+unsigned char *u;
+uint32_t *rows[MATRIX_ROWS];
+
+memset(fb, 0, sizeof(uint32_t) * MATRIX_ROWS * FB_WORDS);
+
+u = (unsigned char *)s;
+
+n = large_fit(u, len, &width);
+
+x = (MATRIX_LINE_PIXELS - width) / 2;
+for(i = 0; i < n; i++)
+	{
+	for(y = 0; y < MATRIX_ROWS * large_scale; y++)
+		{
+		large_put(fb, x, y, large_glyph[u[i] ].row[y], large_glyph[u[i] ].width);
+		}
+	x += large_glyph[u[i] ].width;
+	}
+
+// the rest of the line does not fit
+while( (n < len) && u[n] && (u[n] != '\n') ) n++;
+if( (n < len) && (u[n] == '\n') ) n++;
+
+line = large_scale;
+if( (line >= MATRIX_LINES) || (n >= len) ) return;
+
+if(font)
+	{
+	for(r = 0; r < MATRIX_ROWS; r++)
+		{
+		rows[r] = fb[r];
+		}
+
+	font_render(rows, line * MATRIX_LINE_PIXELS, MATRIX_LINE_PIXELS, u + n, len - n);
+	return;
+	}
+
+for(i = 0; (i < MATRIX_LINE_CHARS) && (n + i < len) && u[n + i] && (u[n + i] != '\n'); i++)
+	{
+	render_char(fb, (line * MATRIX_LINE_CHARS) + i, u[n + i]);
+	}
+
+} /* end function large_text */
+
+
+
+/* render the characters of text that changed since the last call into the framebuffer */
+int framebuffer_update(char *s)
+{
+int i, changed;
+
+if(font || large_glyph)
+	{
+	if(framebuffer_valid && (memcmp(rendered_text, s, sizeof(text) ) == 0) ) return 0;
+
+	i = strnlen(s, sizeof(text) );
+	if(large_glyph) large_text(framebuffer, s, i);
+	else font_text(framebuffer, s, i);
+	memcpy(rendered_text, s, sizeof(text) );
+	chars_rendered += i;
+	framebuffer_valid = 1;
+
+	return 1;
+	}
+
+if(!framebuffer_valid)
+	{
+	render_text(framebuffer, s);
+	memcpy(rendered_text, s, MATRIX_CHARS);
+	chars_rendered += MATRIX_CHARS;
+	framebuffer_valid = 1;
+
+	return 1;
+	}
+
+changed = 0;
+for(i = 0; i < MATRIX_CHARS; i++)
+	{
+	if(rendered_text[i] != s[i]) changed++;
+	}
+
+// from a line of changes on packing whole rows is faster than a character at a time
+if(changed >= MATRIX_LINE_CHARS)
+	{
+	render_text(framebuffer, s);
+	memcpy(rendered_text, s, MATRIX_CHARS);
+	chars_rendered += changed;
+
+	return 1;
+	}
+
+for(i = 0; changed && (i < MATRIX_CHARS); i++)
+	{
+	if(rendered_text[i] == s[i]) continue;
+
+	render_char(framebuffer, i, (unsigned char)s[i]);
+	rendered_text[i] = s[i];
+	chars_rendered++;
+	}
+
+return changed != 0;
+} /* end function framebuffer_update */
+
+
+
+/*
+Marquee.
+Horizontal scroll renders each incoming character once into a strip, a ring of packed bits per font row,
+and moves the 270 pixel viewport over the strip one pixel per step.
+The chain is one 270 pixel line folded over the three text lines, so the viewport is just 9 words taken from the strip.
+strip_view and strip_end are free running pixel counters, masked on access.
+*/
+#define STRIP_WORDS				256		/* power of 2, 8192 pixels */
+#define STRIP_BITS				(STRIP_WORDS * 32)
+
+uint32_t strip[MATRIX_ROWS][STRIP_WORDS];
+uint32_t strip_view;		/* first pixel in the viewport */
+uint32_t strip_end;			/* first pixel after the rendered text */
+
+
+
+void strip_reset()
+{
+memset(strip, 0, sizeof(strip) );
+
+strip_view = 0;
+strip_end = MATRIX_CHAIN_BITS; // start with an empty display
+
+} /* end function strip_reset */
+
+
+
+/* pixels rendered but not yet in the viewport */
+int strip_pending()
+{
+return (int)(strip_end - strip_view - MATRIX_CHAIN_BITS);
+} /* end function strip_pending */
+
+
+
+/* room for one more character */
+int strip_room()
+{
+return (strip_end + FONT_WIDTH_MAX - strip_view) <= STRIP_BITS;
+} /* end function strip_room */
+
+
+
+void strip_append(int c)
+{
+int r, i, j, s, width;
+uint32_t slice, mask;
+
+i = (strip_end >> 5) & (STRIP_WORDS - 1);
+j = (i + 1) & (STRIP_WORDS - 1);
+s = strip_end & 31;
+
+c &= 255;
+width = font ? font->glyph[c].width : FONT_PITCH;
+mask = (1u << width) - 1;
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	// BDF ink can reach past the advance width
+	slice = (font ? font->glyph[c].row[r] : glyph_row[c][r]) & mask;
+
+	strip[r][i] = (strip[r][i] & ~(mask << s) ) | (slice << s);
+
+	// straddles a word boundary
+	if(s + width > 32)
+		{
+		strip[r][j] = (strip[r][j] & ~(mask >> (32 - s) ) ) | (slice >> (32 - s) );
+		}
+	}
+
+strip_end += width;
+
+} /* end function strip_append */
+
+
+
+/* copy the viewport to the framebuffer, word wide funnel shifts */
+void strip_to_framebuffer()
+{
+int r, w, i, s;
+uint32_t word;
+
+i = (strip_view >> 5) & (STRIP_WORDS - 1);
+s = strip_view & 31;
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	for(w = 0; w < FB_WORDS; w++)
+		{
+		word = strip[r][(i + w) & (STRIP_WORDS - 1)] >> s;
+		if(s) word |= strip[r][(i + w + 1) & (STRIP_WORDS - 1)] << (32 - s);
+
+		framebuffer[r][w] = word;
+		}
+	}
+
+framebuffer_dirty = 1;
+
+} /* end function strip_to_framebuffer */
+
+
+
+/*
+Vertical canvas.
+Vertical scroll keeps the 21 visible pixel rows plus an off screen line in a ring of 90 pixel rows.
+A new line is rendered once off screen, every scroll step just moves vcanvas_top by one pixel row,
+and the visible rows are copied to the framebuffer: pixel row y goes to font row y % 7 of text line y / 7.
+*/
+#define VCANVAS_ROWS			32		/* power of 2, at least 21 + 7 */
+#define VCANVAS_WORDS			( (MATRIX_LINE_PIXELS + 31) / 32)
+#define VCANVAS_VISIBLE			(MATRIX_LINES * MATRIX_ROWS)
+#define VSCROLL_STEP_MS			30		/* longest time per pixel row while a line slides in */
+
+uint32_t vcanvas[VCANVAS_ROWS][VCANVAS_WORDS];
+int vcanvas_top;			/* first visible row, masked on access */
+
+
+
+void vcanvas_clear()
+{
+memset(vcanvas, 0, sizeof(vcanvas) );
+
+} /* end function vcanvas_clear */
+
+
+
+/* render a text line of 15 characters, or what fits with -F, into 7 canvas rows starting at first_row */
+void vcanvas_render_line(int first_row, char *line)
+{
+int r;
+uint32_t *rows[MATRIX_ROWS];
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	rows[r] = vcanvas[(first_row + r) & (VCANVAS_ROWS - 1)];
+
+	if(font) memset(rows[r], 0, sizeof(uint32_t) * VCANVAS_WORDS);
+	else glyph_pack(rows[r], (unsigned char *)line, MATRIX_LINE_CHARS, r);
+	}
+
+if(font) font_render(rows, 0, MATRIX_LINE_PIXELS, (unsigned char *)line, MATRIX_LINE_MAX);
+
+} /* end function vcanvas_render_line */
+
+
+
+void vcanvas_to_framebuffer()
+{
+int y, w, p;
+uint32_t *row;
+
+for(y = 0; y < VCANVAS_VISIBLE; y++)
+	{
+	row = vcanvas[(vcanvas_top + y) & (VCANVAS_ROWS - 1)];
+	p = (y / MATRIX_ROWS) * MATRIX_LINE_PIXELS;
+
+	for(w = 0; w < VCANVAS_WORDS - 1; w++)
+		{
+		put_bits(framebuffer[y % MATRIX_ROWS], p + (w * 32), row[w], 32);
+		}
+
+	put_bits(framebuffer[y % MATRIX_ROWS], p + (w * 32), row[w], MATRIX_LINE_PIXELS - (w * 32) );
+	}
+
+framebuffer_dirty = 1;
+
+} /* end function vcanvas_to_framebuffer */
+
+
+
+/*
+Row programs.
+Each hardware row is compiled into a flat list of GPIO register writes: 270 data bits, blank, strobe, row select.
+The data is shifted in while the previous row is still lit, the refresh thread waits for the end of that row's
+time between the two parts, then the panel is blanked so the strobe does not show the new data on the old row.
+An op is the GPIO mask to write, with OP_CLR set it goes to the clear register (gpio + 10), else to the set register (gpio + 7).
+The shift register samples data on the rising clock edge, so data going low can share the write with the clock going low,
+and data that does not change is not written again.
+The same row is also packed into bytes for backends that shift the chain out in one go (SPI),
+shift_start and shift_end mark the ops those backends replace, shift_end is also where the wait goes.
+*/
+#define OP_CLR					(1u << 31)
+#define ROW_PROGRAM_MAX			( (3 * MATRIX_CHAIN_BITS) + 8)
+#define ROW_BYTES				( (MATRIX_CHAIN_BITS + 7) / 8)
+#define ROW_PAD_BITS			( (ROW_BYTES * 8) - MATRIX_CHAIN_BITS)
+
+struct row_program
+	{
+	int count;
+	int shift_start;			/* first data or clock op */
+	int shift_end;				/* first blank, strobe and row select op */
+	uint32_t op[ROW_PROGRAM_MAX];
+	uint8_t bytes[ROW_BYTES];
+	};
+
+/* what the refresh thread scans out, one program per bitplane and row */
+struct frame
+	{
+	struct row_program row[GRAY_PLANES_MAX][MATRIX_ROWS];
+	};
+
+
+
+/*
+Pack a framebuffer row in shift order, most significant bit first: chain position 269 is sent first
+and ends up at the far end of the chain, position 0 is sent last.
+270 bits do not fill 34 bytes, the 2 padding bits are sent first so they are shifted out of the chain again.
+*/
+void pack_row(uint8_t *bytes, uint32_t *fb_row)
+{
+int i, p;
+
+memset(bytes, 0, ROW_BYTES);
+
+for(i = ROW_PAD_BITS; i < ROW_BYTES * 8; i++)
+	{
+	p = (ROW_BYTES * 8 - 1) - i;
+
+	if( (fb_row[p >> 5] >> (p & 31) ) & 1) bytes[i >> 3] |= 0x80 >> (i & 7);
+	}
+
+} /* end function pack_row */
+
+
+
+void compile_row(struct row_program *prog, uint32_t *fb_row, int row)
+{
+int p;
+int bit, data;
+uint32_t clr;
+
+prog->count = 0;
+
+pack_row(prog->bytes, fb_row);
+
+/* pixels from framebuffer to shift registers, clock and data are low at the start */
+prog->shift_start = prog->count;
+data = 0;
+for(p = MATRIX_CHAIN_BITS - 1; p >= 0; p--)
+	{
+	bit = (fb_row[p >> 5] >> (p & 31) ) & 1;
+
+	if(bit != data)
+		{
+		if(bit) prog->op[prog->count++] = MATRIX_SHIFT_REGISTER_DATA;
+		else prog->op[prog->count - 1] |= MATRIX_SHIFT_REGISTER_DATA; // with previous clock low, data starts low so never the first bit
+
+		data = bit;
+		}
+
+	// toggle shift register clock
+	prog->op[prog->count++] = MATRIX_SHIFT_REGISTER_CLOCK;
+	prog->op[prog->count++] = OP_CLR | MATRIX_SHIFT_REGISTER_CLOCK;
+	}
+
+// leave data low
+if(data) prog->op[prog->count - 1] |= MATRIX_SHIFT_REGISTER_DATA;
+
+prog->shift_end = prog->count;
+
+/* blank, latch shift register data to output, then light the row */
+prog->op[prog->count++] = MATRIX_ROW_BLANK;
+
+prog->op[prog->count++] = MATRIX_STROBE;
+prog->op[prog->count++] = OP_CLR | MATRIX_STROBE;
+
+// from row 7 all select lines are high, clear the ones that are low for this row
+clr = 0;
+if(!(row & 1) ) clr |= MATRIX_ROW_SELECT_A;
+if(!(row & 2) ) clr |= MATRIX_ROW_SELECT_B;
+if(!(row & 4) ) clr |= MATRIX_ROW_SELECT_C;
+
+// row 7 (display off) has none, an empty write is an error for the GPIO character device
+if(clr) prog->op[prog->count++] = OP_CLR | clr;
+
+} /* end function compile_row */
+
+
+
+/*
+Grayscale.
+With -G the panel shows 2 to 4 bits per pixel with binary code modulation: every row is shifted out once
+per bitplane and bitplane n is lit 2^n times as long as bitplane 0.
+gray holds the level of every pixel, it follows the framebuffer, with a fade time it moves one level
+per step towards it. A lit pixel is at the level of its text line: the highest, or a quarter of it for a line
+that is background, the landscape of the effects and the date under the -L 2 clock.
+*/
+#define GRAY_DIM(max)			( ( (max) + 1) / 4)
+
+int gray_planes = 1;
+int gray_fade_ms;
+uint8_t gray[MATRIX_ROWS][MATRIX_CHAIN_BITS];
+uint8_t gray_level[MATRIX_LINES];		/* of a lit pixel per text line */
+
+
+
+/* one bitplane of a row of gray levels in framebuffer layout */
+void gray_plane(uint32_t *fb_row, uint8_t *levels, int plane)
+{
+int p;
+
+memset(fb_row, 0, FB_WORDS * sizeof(uint32_t) );
+
+for(p = 0; p < MATRIX_CHAIN_BITS; p++)
+	{
+	fb_row[p >> 5] |= (uint32_t)( (levels[p] >> plane) & 1) << (p & 31);
+	}
+
+} /* end function gray_plane */
+
+
+
+void compile_frame(struct frame *f)
+{
+int row, plane;
+uint32_t fb_row[FB_WORDS];
+
+if(gray_planes == 1)
+	{
+	for(row = 0; row < MATRIX_ROWS; row++)
+		{
+		compile_row(&f->row[0][row], framebuffer[row], row);
+		}
+
+	return;
+	}
+
+for(plane = 0; plane < gray_planes; plane++)
+	{
+	for(row = 0; row < MATRIX_ROWS; row++)
+		{
+		gray_plane(fb_row, gray[row], plane);
+		compile_row(&f->row[plane][row], fb_row, row);
+		}
+	}
+
+} /* end function compile_frame */
+
+
+
+/*
+GPIO backends.
+All output goes through a backend: set and clear write GPIO masks, run replays part of a compiled row program,
+frame is called after each complete frame.
+mem      /dev/mem, needs root and the peripheral base of the Pi model.
+gpiomem  /dev/gpiomem, same registers, no root needed, no peripheral base needed.
+cdev     the GPIO character device, one ioctl per write, slower but works on any Pi and with gpio-sim.
+spi      the SPI controller shifts the row out, strobe and row select on GPIO.
+sim      a simulated FDS132 for testing and benchmarking without hardware.
+*/
+void mmap_set(uint32_t mask)
+{
+*(gpio + 7) = mask;
+
+} /* end function mmap_set */
+
+
+
+void mmap_clr(uint32_t mask)
+{
+*(gpio + 10) = mask;
+
+} /* end function mmap_clr */
+
+
+
+void mmap_run(struct row_program *prog, int from, int to)
+{
+int i;
+uint32_t op;
+
+for(i = from; i < to; i++)
+	{
+	op = prog->op[i];
+
+	if(op & OP_CLR) *(gpio + 10) = op & ~OP_CLR;
+	else *(gpio + 7) = op;
+
+	io_delay();
+	}
+
+} /* end function mmap_run */
+
+
+
+/* set I/O directions */
+void mmap_setup_pins()
+{
+int i;
+
+/*
+Note:
+GPIO 2 and GPIO 3 have 1k8 pull up resistors!!!
+
+must use INP_GPIO before we can use OUT_GPIO
+*/
+
+/*
+8-11, 21-24 are output
+no inputs
+*/
+
+// Set GPIO pins 8-11 to output
+for(i = 8; i <= 11; i++)
+	{
+    INP_GPIO(i);
+    OUT_GPIO(i);
+	}
+
+// Set GPIO pins 22-24 to output
+for(i = 21; i <= 24; i++)
+	{
+    INP_GPIO(i);
+    OUT_GPIO(i);
+	}
+
+} /* end function mmap_setup_pins */
+
+
+
+void mem_open()
+{
+gpioHardwareRevision(); /* sets piModel, needed for peripherals address */
+
+// Set up gpio pointer for direct register access
+setup_io();
+
+mmap_setup_pins();
+
+} /* end function mem_open */
+
+
+
+void gpiomem_map()
+{
+/* /dev/gpiomem maps the GPIO registers at offset 0 on every Pi model */
+if ((mem_fd = open("/dev/gpiomem", O_RDWR|O_SYNC) ) < 0)
+	{
+	printf("can't open /dev/gpiomem \n");
+	exit(-1);
+	}
+
+gpio_map = mmap(NULL, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, mem_fd, 0);
+
+close(mem_fd); // No need to keep mem_fd open after mmap
+
+if(gpio_map == MAP_FAILED)
+	{
+	printf("mmap error %d\n", errno);
+	exit(-1);
+	}
+
+// Always use volatile pointer!
+gpio = (volatile unsigned *)gpio_map;
+
+} /* end function gpiomem_map */
+
+
+
+void gpiomem_open()
+{
+gpiomem_map();
+
+mmap_setup_pins();
+
+} /* end function gpiomem_open */
+
+
+
+struct gpio_backend mem_backend = { "mem", mem_open, mmap_set, mmap_clr, mmap_run, NULL, NULL };
+struct gpio_backend gpiomem_backend = { "gpiomem", gpiomem_open, mmap_set, mmap_clr, mmap_run, NULL, NULL };
+
+
+
+/*
+Simulated display.
+Decodes the pin levels like the FDS132 does: data is shifted into the chain on the rising clock edge,
+the rising strobe edge latches the chain, the selected row shows the latch.
+Every interval between display changes is credited to the row and latch content it showed.
+Per frame, each panel row takes the content it showed for the most register writes, so a row select passing
+through other rows for one write does not count, and neither does data that is only shown between a strobe
+and the next row select. Counting writes instead of time keeps the image exact however slow the simulation runs.
+The panel image is kept in framebuffer layout (panel row y % 7, chain position), so it can be compared bit for bit.
+Lit time per pixel is accumulated in nanoseconds, and register writes and edges are counted.
+With -g sim the panel is printed on stdout whenever it changes.
+*/
+#define SIM_ROWS				8		/* row select values, 7 is not a row */
+
+struct sim_counters
+	{
+	uint64_t writes;
+	uint64_t clock_edges;
+	uint64_t data_edges;
+	uint64_t strobe_edges;
+	uint64_t row_changes;
+	uint64_t frames;
+	};
+
+struct sim_counters sim_count;
+uint32_t sim_level;
+uint32_t sim_shift[FB_WORDS];
+uint32_t sim_latch[FB_WORDS];
+uint32_t sim_shown[SIM_ROWS][FB_WORDS];			/* content each row showed longest this frame */
+uint64_t sim_shown_writes[SIM_ROWS];
+uint64_t sim_since_writes;						/* start of the current display interval */
+int64_t sim_since;
+uint32_t sim_image[MATRIX_ROWS][FB_WORDS];
+uint32_t sim_printed[MATRIX_ROWS][FB_WORDS];
+uint64_t sim_lit_ns[MATRIX_ROWS][MATRIX_CHAIN_BITS];
+int sim_print;
+
+
+
+int sim_row()
+{
+int row;
+
+row = 0;
+if(sim_level & MATRIX_ROW_SELECT_A) row |= 1;
+if(sim_level & MATRIX_ROW_SELECT_B) row |= 2;
+if(sim_level & MATRIX_ROW_SELECT_C) row |= 4;
+
+return row;
+} /* end function sim_row */
+
+
+
+/* credit the display interval that ends now */
+void sim_account()
+{
+int row, w;
+int64_t now, ns;
+uint64_t writes;
+uint32_t bits;
+
+now = monotonic_ns();
+ns = now - sim_since;
+sim_since = now;
+
+// the write that ends the interval is part of it
+writes = sim_count.writes - sim_since_writes;
+sim_since_writes = sim_count.writes;
+
+row = sim_row();
+if(row >= MATRIX_ROWS) return;
+
+if(memcmp(sim_shown[row], sim_latch, sizeof(sim_latch) ) == 0) sim_shown_writes[row] += writes;
+else if(writes > sim_shown_writes[row])
+	{
+	memcpy(sim_shown[row], sim_latch, sizeof(sim_latch) );
+	sim_shown_writes[row] = writes;
+	}
+
+for(w = 0; w < FB_WORDS; w++)
+	{
+	for(bits = sim_latch[w]; bits; bits &= bits - 1)
+		{
+		sim_lit_ns[row][(w * 32) + __builtin_ctz(bits)] += ns;
+		}
+	}
+
+} /* end function sim_account */
+
+
+
+void sim_write(uint32_t level)
+{
+int w;
+uint32_t changed, rising, carry, next;
+
+sim_count.writes++;
+
+changed = level ^ sim_level;
+rising = changed & level;
+
+if(changed & MATRIX_SHIFT_REGISTER_DATA) sim_count.data_edges++;
+
+if(rising & MATRIX_SHIFT_REGISTER_CLOCK)
+	{
+	sim_count.clock_edges++;
+
+	// data that changes in the same write as the clock is not trusted, use the old level
+	carry = (sim_level & MATRIX_SHIFT_REGISTER_DATA) ? 1 : 0;
+	for(w = 0; w < FB_WORDS; w++)
+		{
+		next = sim_shift[w] >> 31;
+		sim_shift[w] = (sim_shift[w] << 1) | carry;
+		carry = next;
+		}
+
+	// bits beyond the chain fall out
+	sim_shift[FB_WORDS - 1] &= (1u << (MATRIX_CHAIN_BITS & 31) ) - 1;
+	}
+
+if( (rising & MATRIX_STROBE) || (changed & (MATRIX_ROW_SELECT_A | MATRIX_ROW_SELECT_B | MATRIX_ROW_SELECT_C) ) )
+	{
+	sim_account();
+	}
+
+if(rising & MATRIX_STROBE)
+	{
+	sim_count.strobe_edges++;
+	memcpy(sim_latch, sim_shift, sizeof(sim_latch) );
+	}
+
+if(changed & (MATRIX_ROW_SELECT_A | MATRIX_ROW_SELECT_B | MATRIX_ROW_SELECT_C) ) sim_count.row_changes++;
+
+sim_level = level;
+
+} /* end function sim_write */
+
+
+
+void sim_set(uint32_t mask)
+{
+sim_write(sim_level | mask);
+
+} /* end function sim_set */
+
+
+
+void sim_clr(uint32_t mask)
+{
+sim_write(sim_level & ~mask);
+
+} /* end function sim_clr */
+
+
+
+void sim_run(struct row_program *prog, int from, int to)
+{
+int i;
+uint32_t op;
+
+for(i = from; i < to; i++)
+	{
+	op = prog->op[i];
+
+	if(op & OP_CLR) sim_write(sim_level & ~op);
+	else sim_write(sim_level | op);
+	}
+
+} /* end function sim_run */
+
+
+
+/* pixel x, y of the 90 x 21 panel */
+int sim_pixel(int x, int y)
+{
+int p;
+
+p = ( (y / MATRIX_ROWS) * MATRIX_LINE_PIXELS) + x;
+
+return (sim_image[y % MATRIX_ROWS][p >> 5] >> (p & 31) ) & 1;
+} /* end function sim_pixel */
+
+
+
+void sim_dump(FILE *fptr)
+{
+int x, y;
+char buffer[(MATRIX_LINES * MATRIX_ROWS) * (MATRIX_LINE_PIXELS + 1) + 2];
+char *p;
+
+p = buffer;
+for(y = 0; y < MATRIX_LINES * MATRIX_ROWS; y++)
+	{
+	for(x = 0; x < MATRIX_LINE_PIXELS; x++)
+		{
+		*p++ = sim_pixel(x, y) ? '#' : '.';
+		}
+
+	*p++ = '\n';
+	}
+*p++ = '\n';
+
+fwrite(buffer, 1, p - buffer, fptr);
+
+} /* end function sim_dump */
+
+
+
+void sim_frame()
+{
+int row;
+
+sim_count.frames++;
+
+sim_account();
+
+for(row = 0; row < MATRIX_ROWS; row++)
+	{
+	// a row that was not selected this frame is dark
+	if(sim_shown_writes[row]) memcpy(sim_image[row], sim_shown[row], sizeof(sim_image[row]) );
+	else memset(sim_image[row], 0, sizeof(sim_image[row]) );
+	sim_shown_writes[row] = 0;
+	}
+
+if(!sim_print) return;
+if(memcmp(sim_image, sim_printed, sizeof(sim_image) ) == 0) return;
+
+memcpy(sim_printed, sim_image, sizeof(sim_image) );
+sim_dump(stdout);
+
+} /* end function sim_frame */
+
+
+
+void sim_report()
+{
+if(!sim_count.frames) return;
+
+fprintf(stderr, "sim: %.1f register writes, %.1f clock edges, %.1f data edges per frame\n",\
+(double)sim_count.writes / sim_count.frames, (double)sim_count.clock_edges / sim_count.frames,\
+(double)sim_count.data_edges / sim_count.frames);
+
+} /* end function sim_report */
+
+
+
+void sim_open()
+{
+sim_print = 1;
+sim_since = monotonic_ns();
+
+} /* end function sim_open */
+
+
+
+struct gpio_backend sim_backend = { "sim", sim_open, sim_set, sim_clr, sim_run, sim_frame, sim_report };
+
+
+
+/*
+GPIO character device backend.
+Uses the Linux GPIO v2 uAPI: all six lines are requested as one line group, a write sets and clears any
+of them in a single ioctl. No root needed (gpio group), no peripheral base, works on every Pi model
+and on a PC with the kernel's gpio-sim module.
+Because one ioctl can set and clear at the same time, a clear followed by a set of other lines is merged
+into one write, unless the set raises the clock or the strobe. In a row program that is the clock going low
+with the next data bit going high, and the last clock going low with the blank (all row selects high).
+The row selects never go from the old row to the new one in one write: blank, strobe, then the new row's
+selects are cleared, each a write of its own.
+
+Test on a PC without hardware, as root (the chip needs at least 25 lines):
+ modprobe gpio-sim
+ mkdir /sys/kernel/config/gpio-sim/fds132
+ mkdir /sys/kernel/config/gpio-sim/fds132/gpio-bank0
+ echo 32 > /sys/kernel/config/gpio-sim/fds132/gpio-bank0/num_lines
+ echo 1 > /sys/kernel/config/gpio-sim/fds132/live
+ FDS132_matrix_display -g cdev:/dev/gpiochipN -v -t "Hello"
+The line levels can then be read in /sys/devices/platform/gpio-sim.N/gpiochipN/sim_gpioX/value.
+*/
+#define CDEV_DEFAULT_CHIP		"/dev/gpiochip0"
+#define CDEV_LINES				6
+
+int cdev_fd = -1;
+uint32_t cdev_pin[CDEV_LINES] = { 8, 9, 11, 22, 23, 24 };
+
+
+
+/* GPIO mask to line group bits */
+uint64_t cdev_bits(uint32_t mask)
+{
+int i;
+uint64_t bits;
+
+bits = 0;
+for(i = 0; i < CDEV_LINES; i++)
+	{
+	if(mask & (1u << cdev_pin[i]) ) bits |= (1ULL << i);
+	}
+
+return bits;
+} /* end function cdev_bits */
+
+
+
+void cdev_write(uint64_t mask, uint64_t bits)
+{
+struct gpio_v2_line_values values;
+
+// the kernel rejects a write of no lines
+if(!mask || atomic_load(&backend_failed) ) return;
+
+values.mask = mask;
+values.bits = bits;
+
+if(ioctl(cdev_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
+	{
+	backend_fail("cdev_write(): GPIO_V2_LINE_SET_VALUES_IOCTL");
+	}
+
+} /* end function cdev_write */
+
+
+
+void cdev_set(uint32_t mask)
+{
+cdev_write(cdev_bits(mask), cdev_bits(mask) );
+
+} /* end function cdev_set */
+
+
+
+void cdev_clr(uint32_t mask)
+{
+cdev_write(cdev_bits(mask), 0);
+
+} /* end function cdev_clr */
+
+
+
+void cdev_run(struct row_program *prog, int from, int to)
+{
+int i;
+uint32_t op, next;
+uint64_t mask, bits;
+
+for(i = from; i < to; i++)
+	{
+	op = prog->op[i];
+
+	mask = cdev_bits(op & ~OP_CLR);
+	if(op & OP_CLR) bits = 0;
+	else bits = mask;
+
+	// a clear and the following set in one write, rising clock and strobe edges stay on their own
+	if( (op & OP_CLR) && (i + 1 < to) )
+		{
+		next = prog->op[i + 1];
+		if( !(next & (OP_CLR | MATRIX_SHIFT_REGISTER_CLOCK | MATRIX_STROBE) ) )
+			{
+			mask |= cdev_bits(next);
+			bits |= cdev_bits(next);
+			i++;
+			}
+		}
+
+	cdev_write(mask, bits);
+
+	io_delay();
+	}
+
+} /* end function cdev_run */
+
+
+
+void cdev_open()
+{
+int i, fd;
+char *chip;
+struct gpio_v2_line_request request;
+
+chip = backend_arg ? backend_arg : CDEV_DEFAULT_CHIP;
+
+fd = open(chip, O_RDWR | O_CLOEXEC);
+if(fd < 0)
+	{
+	fprintf(stderr, "can't open %s: %s\n", chip, strerror(errno) );
+	exit(-1);
+	}
+
+memset(&request, 0, sizeof(request) );
+for(i = 0; i < CDEV_LINES; i++)
+	{
+	request.offsets[i] = cdev_pin[i];
+	}
+request.num_lines = CDEV_LINES;
+strcpy(request.consumer, "FDS132");
+
+// all outputs, starting low
+request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+request.config.num_attrs = 1;
+request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+request.config.attrs[0].attr.values = 0;
+request.config.attrs[0].mask = (1ULL << CDEV_LINES) - 1;
+
+if(ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &request) < 0)
+	{
+	fprintf(stderr, "can't request GPIO lines on %s: %s\n", chip, strerror(errno) );
+	exit(-1);
+	}
+
+close(fd); // the line request has its own descriptor
+
+cdev_fd = request.fd;
+
+} /* end function cdev_open */
+
+
+
+struct gpio_backend cdev_backend = { "cdev", cdev_open, cdev_set, cdev_clr, cdev_run, NULL, NULL };
+
+
+
+/*
+SPI backend.
+The SPI controller shifts each row out in one transfer, from the bytes packed by compile_row(),
+strobe and row select stay on GPIO through /dev/gpiomem. SPI mode 0: the clock idles low and
+data changes on the falling edge, the shift registers sample it on the rising edge.
+The SPI clock is 1 / (2 * bit delay), so -n works as with the other backends, or give it in Hz.
+Wiring: data moves from GPIO9 to MOSI (GPIO10, pin 19), the clock is already on SCLK (GPIO11).
+The strobe on GPIO8 is CE0, so move the chip select out of the way in config.txt:
+ dtoverlay=spi0-1cs,cs0_pin=7
+Test without a display: wire MOSI to MISO (GPIO10 to GPIO9) and run with -v, every row must read back.
+Test without a Pi: -g spi:sim clocks the bytes bit by bit into the simulated display.
+*/
+#define SPI_DEFAULT_DEVICE		"/dev/spidev0.0"
+#define SPI_MAX_HZ				16000000
+
+struct spi_counters
+	{
+	uint64_t transfers;
+	uint64_t read_back;
+	uint64_t errors;			/* failed transfers, only the first is printed */
+	};
+
+int spi_fd = -1;
+uint32_t spi_hz;
+struct gpio_backend *spi_gpio;		/* strobe and row select */
+struct spi_counters spi_count;
+uint8_t spi_rx[ROW_BYTES];
+
+
+
+/* a stretch of the row program, row select or strobe */
+void spi_ops(struct row_program *prog, int from, int to)
+{
+int i;
+uint32_t op;
+
+for(i = from; i < to; i++)
+	{
+	op = prog->op[i];
+
+	if(op & OP_CLR) spi_gpio->clr(op & ~OP_CLR);
+	else spi_gpio->set(op);
+
+	io_delay();
+	}
+
+} /* end function spi_ops */
+
+
+
+/* stub transfer, the simulated display sees the bits as the SPI controller would clock them */
+void spi_sim_transfer(uint8_t *bytes)
+{
+int i;
+
+for(i = 0; i < ROW_BYTES * 8; i++)
+	{
+	if(bytes[i >> 3] & (0x80 >> (i & 7) ) ) sim_set(MATRIX_SHIFT_REGISTER_DATA);
+	else sim_clr(MATRIX_SHIFT_REGISTER_DATA);
+
+	sim_set(MATRIX_SHIFT_REGISTER_CLOCK);
+	sim_clr(MATRIX_SHIFT_REGISTER_CLOCK);
+	}
+
+sim_clr(MATRIX_SHIFT_REGISTER_DATA);
+
+} /* end function spi_sim_transfer */
+
+
+
+void spi_transfer(uint8_t *bytes)
+{
+struct spi_ioc_transfer transfer;
+
+spi_count.transfers++;
+
+if(spi_fd < 0)
+	{
+	spi_sim_transfer(bytes);
+	return;
+	}
+
+memset(&transfer, 0, sizeof(transfer) );
+transfer.tx_buf = (uintptr_t)bytes;
+transfer.rx_buf = (uintptr_t)spi_rx;
+transfer.len = ROW_BYTES;
+transfer.speed_hz = spi_hz;
+transfer.bits_per_word = 8;
+
+if(ioctl(spi_fd, SPI_IOC_MESSAGE(1), &transfer) < 0)
+	{
+	// once a row, a device that is gone would flood the log
+	if(!spi_count.errors++) perror("spi_transfer(): SPI_IOC_MESSAGE");
+	return;
+	}
+
+// with MOSI wired to MISO the row comes back
+if(memcmp(spi_rx, bytes, ROW_BYTES) == 0) spi_count.read_back++;
+
+} /* end function spi_transfer */
+
+
+
+void spi_run(struct row_program *prog, int from, int to)
+{
+if( (from > prog->shift_start) || (to < prog->shift_end) )
+	{
+	spi_ops(prog, from, to);
+
+	return;
+	}
+
+spi_ops(prog, from, prog->shift_start);
+
+spi_transfer(prog->bytes);
+
+spi_ops(prog, prog->shift_end, to);
+
+} /* end function spi_run */
+
+
+
+void spi_set(uint32_t mask)
+{
+spi_gpio->set(mask);
+
+} /* end function spi_set */
+
+
+
+void spi_clr(uint32_t mask)
+{
+spi_gpio->clr(mask);
+
+} /* end function spi_clr */
+
+
+
+void spi_frame()
+{
+if(spi_gpio->frame) spi_gpio->frame();
+
+} /* end function spi_frame */
+
+
+
+void spi_report()
+{
+fprintf(stderr, "spi: %u Hz, %d bytes per row, %llu transfers", spi_hz, ROW_BYTES, (unsigned long long)spi_count.transfers);
+if(spi_fd >= 0) fprintf(stderr, ", %llu read back on MISO, %llu failed", (unsigned long long)spi_count.read_back, (unsigned long long)spi_count.errors);
+fprintf(stderr, "\n");
+
+if(spi_gpio->report) spi_gpio->report();
+
+} /* end function spi_report */
+
+
+
+/* only strobe and row select are GPIO outputs, 9, 10 and 11 belong to the SPI controller */
+void spi_setup_pins()
+{
+int i;
+
+INP_GPIO(8);
+OUT_GPIO(8);
+
+for(i = 22; i <= 24; i++)
+	{
+    INP_GPIO(i);
+    OUT_GPIO(i);
+	}
+
+} /* end function spi_setup_pins */
+
+
+
+/* spi[:device[,hz]] */
+void spi_open()
+{
+char device[256];
+char *p;
+uint8_t mode, bits;
+uint32_t hz;
+
+snprintf(device, sizeof(device), "%s", backend_arg ? backend_arg : SPI_DEFAULT_DEVICE);
+
+if(bit_delay_ns > 0) spi_hz = 1000000000 / (2 * bit_delay_ns);
+else spi_hz = SPI_MAX_HZ;
+
+p = strchr(device, ',');
+if(p)
+	{
+	*p = 0;
+	spi_hz = atoi(p + 1);
+	}
+
+if( (spi_hz == 0) || (spi_hz > SPI_MAX_HZ) ) spi_hz = SPI_MAX_HZ;
+
+if(strcmp(device, "sim") == 0)
+	{
+	spi_gpio = &sim_backend;
+	spi_gpio->open();
+
+	return;
+	}
+
+spi_fd = open(device, O_RDWR | O_CLOEXEC);
+if(spi_fd < 0)
+	{
+	fprintf(stderr, "can't open %s: %s\n", device, strerror(errno) );
+	exit(-1);
+	}
+
+// the strobe is not a chip select, not all controllers can do without one
+mode = SPI_MODE_0 | SPI_NO_CS;
+if(ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
+	{
+	mode = SPI_MODE_0;
+	if(ioctl(spi_fd, SPI_IOC_WR_MODE, &mode) < 0)
+		{
+		fprintf(stderr, "can't set SPI mode on %s: %s\n", device, strerror(errno) );
+		exit(-1);
+		}
+	}
+
+bits = 8;
+hz = spi_hz;
+if( (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) || (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz) < 0) )
+	{
+	fprintf(stderr, "can't set up SPI on %s: %s\n", device, strerror(errno) );
+	exit(-1);
+	}
+
+spi_gpio = &gpiomem_backend;
+gpiomem_map();
+spi_setup_pins();
+
+// strobe and row select start low, like the other backends leave them
+mmap_clr(MATRIX_STROBE | MATRIX_ROW_SELECT_A | MATRIX_ROW_SELECT_B | MATRIX_ROW_SELECT_C);
+
+} /* end function spi_open */
+
+
+
+struct gpio_backend spi_backend = { "spi", spi_open, spi_set, spi_clr, spi_run, spi_frame, spi_report };
+
+
+
+struct gpio_backend *gpio_backends[] = { &mem_backend, &gpiomem_backend, &cdev_backend, &spi_backend, &sim_backend, NULL };
+
+
+
+/* name or name:argument */
+struct gpio_backend *find_backend(char *name)
+{
+int i, len;
+char *p;
+
+p = strchr(name, ':');
+if(p)
+	{
+	len = p - name;
+	backend_arg = p + 1;
+	}
+else
+	{
+	len = strlen(name);
+	backend_arg = NULL;
+	}
+
+for(i = 0; gpio_backends[i]; i++)
+	{
+	if( (strlen(gpio_backends[i]->name) == len) && (strncmp(gpio_backends[i]->name, name, len) == 0) ) return gpio_backends[i];
+	}
+
+return NULL;
+} /* end function find_backend */
+
+
+
+/*
+Telemetry.
+Durations go into histograms with power of 2 buckets from 1 us up, each histogram has a single writer,
+so a count is a relaxed load and store, no locked instructions in the refresh loop.
+Readers see a bucket either before or after the increment, good enough for monitoring.
+Nothing is measured unless the stats socket (-S) is open.
+*/
+#define HIST_BUCKETS			25		/* < 1 us, < 2 us, ... < 8.4 s, more */
+
+struct histogram
+	{
+	atomic_ullong bucket[HIST_BUCKETS];
+	atomic_ullong sum_ns;
+	};
+
+int stats_enabled;
+
+struct histogram row_hist;				/* one row select to the next */
+struct histogram frame_hist;			/* scan out of one frame */
+struct histogram interval_hist;			/* frame start to next frame start, the real refresh rate */
+
+
+
+/* single writer only */
+static inline void counter_add(atomic_ullong *counter, uint64_t n)
+{
+atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+
+} /* end function counter_add */
+
+
+
+void hist_add(struct histogram *h, int64_t ns)
+{
+int i;
+uint64_t us;
+
+if(ns < 0) ns = 0;
+
+us = ns / 1000;
+i = us ? 64 - __builtin_clzll(us) : 0;
+if(i >= HIST_BUCKETS) i = HIST_BUCKETS - 1;
+
+counter_add(&h->bucket[i], 1);
+counter_add(&h->sum_ns, ns);
+
+} /* end function hist_add */
+
+
+
+/*
+Refresh thread.
+The refresh thread only scans out frames, everything else (input, date, file, effects) runs in the main thread.
+Frames are handed over with a triple buffer: the main thread compiles into frame_back, then swaps it with frame_ready,
+the refresh thread swaps frame_front with frame_ready when FRAME_FRESH is set. Neither side ever waits for the other.
+Every row is lit for exactly row_ns: the next row is shifted in while a row is lit, then the thread spins
+until the row's deadline before it blanks, strobes and selects the next row.
+Anything else the refresh thread does (simulator bookkeeping, the rest of a SCHED_FIFO thread) happens
+with the panel blanked, so it makes all rows equally darker instead of one row brighter.
+-r sets row_ns, by default it is measured at startup as the slowest shift plus a margin.
+
+Brightness is the lit part of each row period, in 16ths. The rest of the period the panel is blanked.
+The next row is shifted in during the lit part or during the blank part, whichever is long enough,
+the row period is stretched when neither is. A blank part that is long enough is slept through,
+waking up twice the average wake up latency early and spinning the rest, so the period stays on time.
+
+In eco mode (-E) the row period is a fixed target, 1 ms unless -r says otherwise, and the lit part is slept
+through as well, the row is shifted in as fast as the bit delay allows and the thread sleeps the rest.
+
+With bitplanes each row is scanned once per plane, the most significant plane gets the lit and blank
+parts of a whole row, every lower plane half of the one above. A plane too short to shift in the next
+one gets a blank part as long as a shift, so 4 planes take about 5 times as long as 1, not 15 times.
+
+At brightness 0 the display is off: zeros are latched, row 7 is selected, and the refresh thread waits
+on refresh_wake until the brightness is set again or the program quits.
+*/
+#define FRAME_FRESH				4
+#define REST_LATENCY_NS			50000	/* first guess of the wake up latency */
+#define ECO_ROW_NS				1000000	/* row period in eco mode */
+
+struct frame frame_buffer[3];
+int frame_back = 0;					/* main thread only */
+int frame_front = 1;				/* refresh thread only */
+atomic_int frame_ready = 2;
+atomic_uint frames_shown;
+uint64_t frames_published;			/* main thread only */
+
+int64_t row_ns;						/* row period at full brightness, 0 is measure at startup */
+int eco_flag;						/* sleep through the lit part of the row too */
+atomic_int brightness = BRIGHTNESS_MAX;	/* 0 is display off */
+atomic_ullong row_overruns;			/* rows that took longer to shift than their period */
+
+struct plane_timing
+	{
+	int64_t lit;					/* lit part */
+	int64_t slot;					/* whole period */
+	int shift_first;				/* the next one is shifted in while lit, else after blanking */
+	};
+
+/* refresh thread only */
+int64_t shift_ns;					/* slowest shift of one row, plus margin */
+int64_t slot_ns;					/* row period at the current brightness */
+int64_t lit_ns;						/* lit part of it */
+int timing_level;					/* brightness slot_ns and lit_ns are for */
+struct plane_timing plane_timing[GRAY_PLANES_MAX];
+struct plane_timing *lit_timing = &plane_timing[0];	/* of the row that is lit now */
+int64_t lit_deadline;				/* end of the lit part, 0 is blanked */
+int64_t slot_deadline;				/* end of the row period */
+int64_t rest_latency = REST_LATENCY_NS;	/* average time nanosleep() oversleeps */
+
+int64_t frame_last_start;			/* start of the previous frame, 0 is none */
+
+int realtime_priority;				/* SCHED_FIFO priority of the refresh thread, 0 is normal scheduling */
+int refresh_cpu;					/* CPU to pin the refresh thread to, -1 is any */
+pthread_t refresh_tid;
+int refresh_running;				/* main thread only */
+atomic_int refresh_quit;			/* leave the panel dark and end the refresh thread */
+pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t refresh_wake = PTHREAD_COND_INITIALIZER;	/* brightness or refresh_quit changed */
+
+
+
+/* compile the framebuffer and hand it to the refresh thread */
+void publish_frame()
+{
+compile_frame(&frame_buffer[frame_back]);
+frames_published++;
+
+frame_back = atomic_exchange(&frame_ready, frame_back | FRAME_FRESH) & 3;
+
+} /* end function publish_frame */
+
+
+
+/* row period and lit part for a brightness */
+void refresh_timing(int level)
+{
+int plane, top;
+int shift_first;
+int64_t lit_shift, dark_shift, lit, dark;
+struct plane_timing *t;
+
+timing_level = level;
+
+if(level >= BRIGHTNESS_MAX)
+	{
+	slot_ns = row_ns;
+	lit_ns = row_ns;
+	shift_first = 1;
+	}
+else
+	{
+	// shortest period with a lit part or a dark part as long as a shift
+	lit_shift = (shift_ns * BRIGHTNESS_MAX) / level;
+	if(lit_shift < row_ns) lit_shift = row_ns;
+
+	dark_shift = (shift_ns * BRIGHTNESS_MAX) / (BRIGHTNESS_MAX - level);
+	if(dark_shift < row_ns) dark_shift = row_ns;
+
+	shift_first = (lit_shift <= dark_shift);
+	slot_ns = shift_first ? lit_shift : dark_shift;
+	lit_ns = (slot_ns * level) / BRIGHTNESS_MAX;
+	}
+
+top = gray_planes - 1;
+for(plane = 0; plane < gray_planes; plane++)
+	{
+	t = &plane_timing[plane];
+
+	if(plane == top)
+		{
+		t->lit = lit_ns;
+		t->slot = slot_ns;
+		t->shift_first = shift_first;
+
+		continue;
+		}
+
+	// halve per plane down, make room for the shift if needed
+	lit = lit_ns >> (top - plane);
+	dark = (slot_ns - lit_ns) >> (top - plane);
+
+	t->lit = lit;
+	t->shift_first = (lit >= shift_ns);
+	if(!t->shift_first && (dark < shift_ns) ) dark = shift_ns;
+	t->slot = lit + dark;
+	}
+
+} /* end function refresh_timing */
+
+
+
+/* wait until deadline, sleep first if allowed and there is time, spin the last part to be on time */
+void refresh_until(int64_t deadline, int may_sleep)
+{
+int64_t now, wake, late;
+struct timespec ts;
+
+now = monotonic_ns();
+
+if(may_sleep && (deadline - now > 3 * rest_latency) )
+	{
+	wake = deadline - (2 * rest_latency);
+
+	// the deadlines are CLOCK_MONOTONIC_RAW, clock_nanosleep() needs CLOCK_MONOTONIC
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_nsec += wake - now;
+	ts.tv_sec += ts.tv_nsec / 1000000000LL;
+	ts.tv_nsec %= 1000000000LL;
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+	// a single descheduled wakeup must not make every following row spin
+	late = monotonic_ns() - wake;
+	if(late > 4 * rest_latency) late = 4 * rest_latency;
+	rest_latency += (late - rest_latency) / 8;
+	if(rest_latency < 1000) rest_latency = 1000;
+	}
+
+while(monotonic_ns() < deadline);
+
+} /* end function refresh_until */
+
+
+
+/* end the lit part of the row */
+void refresh_blank()
+{
+if(!lit_deadline) return;
+
+refresh_until(lit_deadline, eco_flag);
+
+backend->set(MATRIX_ROW_BLANK);
+io_delay();
+
+lit_deadline = 0;
+
+} /* end function refresh_blank */
+
+
+
+/* wait for the end of the row period, sleep if the panel is blanked or in eco mode */
+void refresh_rest()
+{
+if(monotonic_ns() > slot_deadline)
+	{
+	if(slot_deadline) counter_add(&row_overruns, 1);
+
+	return;
+	}
+
+refresh_until(slot_deadline, !lit_deadline || eco_flag);
+
+} /* end function refresh_rest */
+
+
+
+/* blank and finish the row period, before doing anything that is not refresh */
+void refresh_pause()
+{
+refresh_blank();
+refresh_until(slot_deadline, 1);
+
+slot_deadline = 0;
+
+} /* end function refresh_pause */
+
+
+
+/* time the slowest possible shift, every bit a data edge, with the panel blanked */
+void row_calibrate()
+{
+int i, w;
+int64_t start, ns, slowest;
+uint32_t fb_row[FB_WORDS];
+static struct row_program prog;
+
+for(w = 0; w < FB_WORDS; w++)
+	{
+	fb_row[w] = 0x55555555;
+	}
+compile_row(&prog, fb_row, 0);
+
+backend->set(MATRIX_ROW_BLANK);
+io_delay();
+
+slowest = 0;
+for(i = 0; i < 4; i++)
+	{
+	start = monotonic_ns();
+	backend->run(&prog, 0, prog.shift_end);
+	ns = monotonic_ns() - start;
+
+	if(ns > slowest) slowest = ns;
+	}
+
+shift_ns = slowest + (slowest * ROW_MARGIN_PERCENT) / 100;
+
+if(!row_ns) row_ns = eco_flag ? ECO_ROW_NS : shift_ns;
+if(row_ns < shift_ns) row_ns = shift_ns;
+
+} /* end function row_calibrate */
+
+
+
+void refresh_frame()
+{
+int row, plane, level;
+struct frame *f;
+struct row_program *prog;
+int64_t start, now, then;
+
+// display off since the check in refresh_thread(), finish this frame as it was
+level = atomic_load_explicit(&brightness, memory_order_relaxed);
+if(level && (level != timing_level) ) refresh_timing(level);
+
+if(atomic_load(&frame_ready) & FRAME_FRESH)
+	{
+	frame_front = atomic_exchange(&frame_ready, frame_front) & 3;
+	}
+
+f = &frame_buffer[frame_front];
+
+start = 0;
+then = 0;
+if(stats_enabled)
+	{
+	start = monotonic_ns();
+	if(frame_last_start) hist_add(&interval_hist, start - frame_last_start);
+	frame_last_start = start;
+	then = start;
+	}
+
+/* process each row in the display */
+for(row = 0; row < MATRIX_ROWS; row++) // all rows in display
+	{
+	for(plane = 0; plane < gray_planes; plane++)
+		{
+		prog = &f->row[plane][row];
+
+		// shift in while the previous row is lit or after it is blanked, then swap rows on time
+		if(lit_timing->shift_first)
+			{
+			backend->run(prog, 0, prog->shift_end);
+			if(lit_timing->lit < lit_timing->slot) refresh_blank();
+			}
+		else
+			{
+			refresh_blank();
+			backend->run(prog, 0, prog->shift_end);
+			}
+
+		refresh_rest();
+
+		backend->run(prog, prog->shift_end, prog->count);
+
+		lit_timing = &plane_timing[plane];
+
+		now = monotonic_ns();
+		lit_deadline = now + lit_timing->lit;
+		slot_deadline = now + lit_timing->slot;
+		}
+
+	if(stats_enabled)
+		{
+		now = monotonic_ns();
+		hist_add(&row_hist, now - then);
+		then = now;
+		}
+	} /* end for all rows */
+
+if(backend->frame)
+	{
+	refresh_pause();
+	backend->frame();
+	}
+
+if(stats_enabled) hist_add(&frame_hist, monotonic_ns() - start);
+
+atomic_fetch_add(&frames_shown, 1);
+
+} /* end function refresh_frame */
+
+
+
+/* display off, zeros latched and row 7 selected, no row driver is on */
+void refresh_off()
+{
+uint32_t fb_row[FB_WORDS];
+static struct row_program prog;
+
+refresh_pause();
+
+memset(fb_row, 0, sizeof(fb_row) );
+compile_row(&prog, fb_row, MATRIX_ROWS);
+backend->run(&prog, 0, prog.count);
+io_delay();
+
+if(backend->frame) backend->frame();
+
+} /* end function refresh_off */
+
+
+
+/* display off until the brightness is set again or the program quits */
+void refresh_park()
+{
+refresh_off();
+
+pthread_mutex_lock(&refresh_mutex);
+while(!atomic_load(&brightness) && !atomic_load(&refresh_quit) )
+	{
+	pthread_cond_wait(&refresh_wake, &refresh_mutex);
+	}
+pthread_mutex_unlock(&refresh_mutex);
+
+// the time off is not a refresh interval
+frame_last_start = 0;
+
+} /* end function refresh_park */
+
+
+
+void *refresh_thread(void *arg)
+{
+int a;
+int frame_count;
+int64_t start;
+double fa;
+struct sched_param param;
+cpu_set_t cpus;
+struct timespec rest;
+
+if(refresh_cpu >= 0)
+	{
+	CPU_ZERO(&cpus);
+	CPU_SET(refresh_cpu, &cpus);
+
+	a = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if(a)
+		{
+		fprintf(stderr, "refresh_thread(): could not pin to CPU %d: %s\n", refresh_cpu, strerror(a) );
+		}
+	}
+
+if(realtime_priority)
+	{
+	param.sched_priority = realtime_priority;
+
+	a = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if(a)
+		{
+		fprintf(stderr, "refresh_thread(): could not set SCHED_FIFO priority %d: %s\n", realtime_priority, strerror(a) );
+		}
+	}
+
+// a SCHED_FIFO thread that never sleeps starves the main thread on a single core Pi
+rest.tv_sec = 0;
+rest.tv_nsec = 50000;
+
+// nanosleep() in the blank part of a row, no extra slack on top of the wake up latency
+prctl(PR_SET_TIMERSLACK, 1);
+
+row_calibrate();
+
+frame_count = 0;
+start = monotonic_ns();
+while(!atomic_load(&refresh_quit) )
+	{
+	if(!atomic_load(&brightness) )
+		{
+		refresh_park();
+
+		// the report is of refresh, not of the time off
+		if(frame_count < 100)
+			{
+			frame_count = 0;
+			start = monotonic_ns();
+			}
+
+		continue;
+		}
+
+	refresh_frame();
+
+	/* report the bit clock we really get, once, then stop counting */
+	if(frame_count <= 100) frame_count++;
+	if(verbose && (frame_count == 100) )
+		{
+		fa = (monotonic_ns() - start) / 100.0; // ns per frame
+
+		fprintf(stderr, "%s: bit delay %d ns, bit clock %.1f kHz, row time %.1f us, lit %.1f us, brightness %d/%d, %d bitplanes, refresh %.1f Hz\n",\
+		backend->name, bit_delay_ns, (gray_planes * MATRIX_ROWS * MATRIX_CHAIN_BITS * 1e6) / fa, slot_ns / 1000.0, lit_ns / 1000.0,\
+		timing_level, BRIGHTNESS_MAX, gray_planes, 1e9 / fa);
+
+		if(backend->report) backend->report();
+		}
+
+	if(realtime_priority)
+		{
+		refresh_pause();
+		nanosleep(&rest, NULL);
+		}
+	}
+
+refresh_off();
+
+return NULL;
+} /* end function refresh_thread */
+
+
+
+#define SCROLL_LEFT		0
+#define SCROLL_UP		1
+#define	SCROLL_DOWN		2
+
+
+#define EFFECT_OFF 							0
+#define EFFECT_SNOW							1
+#define EFFECT_FIREWORKS					2
+
+
+/* content state, main thread only */
+int exit_on_eof_flag;
+int text_flag;
+int date_flag;
+int file_flag;
+int scroll_delay;
+int scroll_mode;
+int three_line_delay;
+int line_cnt;
+int effect_mode;
+int input_line_cnt;
+int file_read_frequency;
+char filename[MAX_FILENAME_LEN];
+
+char fireworks_landscape[] = 	" * **  * *     "; // landscape on bottom line, 15 characters wide, the control B is a christmass tree, use hexedit for example to make these strings
+char snow_landscape[] = 		" * **  * *     ";
+
+
+
+/*
+Scheduler.
+Scroll steps, effect ticks and content updates run at millisecond deadlines on the CLOCK_MONOTONIC timeline,
+so animation speed does not depend on the refresh rate, the Pi model or the length of the text.
+A task returns the number of milliseconds until it wants to run again, -1 to stop,
+or TASK_WAIT to sleep until an event source wakes it.
+*/
+#define TASK_FILE				0
+#define TASK_EFFECT				1
+#define TASK_SCROLL				2
+#define TASK_BRIGHTNESS			3
+#define TASK_FADE				4
+#define TASKS					5
+
+#define NO_DEADLINE				INT64_MAX
+#define TASK_WAIT				-2
+
+struct task
+	{
+	int (*run)();
+	int64_t deadline;
+	int waiting;
+	};
+
+struct task task[TASKS];
+char *task_name[TASKS] = { "file", "effect", "scroll", "brightness", "fade" };
+
+struct histogram task_lateness[TASKS];		/* how late a task ran after its deadline */
+uint64_t task_missed[TASKS];				/* deadlines given up on after a stall */
+
+
+
+int64_t timeline_ns()
+{
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC, &ts);
+
+return ( (int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+} /* end function timeline_ns */
+
+
+
+void task_start(int id, int (*run)(), int delay_ms)
+{
+task[id].run = run;
+task[id].deadline = timeline_ns() + (delay_ms * 1000000LL);
+
+} /* end function task_start */
+
+
+
+void task_stop(int id)
+{
+task[id].deadline = NO_DEADLINE;
+task[id].waiting = 0;
+
+} /* end function task_stop */
+
+
+
+/* run a task that waits for an event now */
+void task_wake(int id)
+{
+if(!task[id].waiting) return;
+
+task[id].deadline = timeline_ns();
+task[id].waiting = 0;
+
+} /* end function task_wake */
+
+
+
+void run_tasks(int64_t now)
+{
+int i, ms;
+
+for(i = 0; i < TASKS; i++)
+	{
+	if(task[i].deadline > now) continue;
+
+	if(stats_enabled) hist_add(&task_lateness[i], now - task[i].deadline);
+
+	ms = task[i].run();
+	if(ms == TASK_WAIT)
+		{
+		task[i].deadline = NO_DEADLINE;
+		task[i].waiting = 1;
+		continue;
+		}
+
+	if(ms < 0)
+		{
+		task_stop(i);
+		continue;
+		}
+
+	/* keep the average rate, but do not try to catch up after a long stall */
+	task[i].deadline += ms * 1000000LL;
+	if(task[i].deadline <= now)
+		{
+		task[i].deadline = now + (ms * 1000000LL);
+		task_missed[i]++;
+		}
+	}
+
+} /* end function run_tasks */
+
+
+
+int64_t next_deadline()
+{
+int i;
+int64_t deadline;
+
+deadline = NO_DEADLINE;
+for(i = 0; i < TASKS; i++)
+	{
+	if(task[i].deadline < deadline) deadline = task[i].deadline;
+	}
+
+return deadline;
+} /* end function next_deadline */
+
+
+
+/*
+Event loop.
+The main thread sleeps in ppoll() until an input descriptor is ready or the next task deadline is due.
+Nothing in the main thread blocks on I/O, a slow producer on stdin only means no new text.
+An event source with a negative fd is ignored by ppoll(), that is how sources are switched off.
+*/
+#define EVENT_SOURCES			8
+
+struct pollfd event_fd[EVENT_SOURCES];
+void (*event_handler[EVENT_SOURCES])();
+int event_sources;
+
+
+
+int event_add(int fd, void (*handler)() )
+{
+if(event_sources == EVENT_SOURCES)
+	{
+	fprintf(stderr, "event_add(): too many event sources\n");
+	exit(1);
+	}
+
+event_fd[event_sources].fd = fd;
+event_fd[event_sources].events = POLLIN;
+event_handler[event_sources] = handler;
+
+return event_sources++;
+} /* end function event_add */
+
+
+
+/*
+Input.
+stdin is read in bulk into a ring buffer, one read() for whatever the pipe has.
+input_head and input_tail are free running, masked on access.
+*/
+#define INPUT_RING_SIZE			65536	/* power of 2 */
+
+unsigned char input_ring[INPUT_RING_SIZE];
+uint32_t input_head;		/* next byte to write */
+uint32_t input_tail;		/* next byte to read */
+uint64_t input_bytes;		/* total read */
+int input_eof;
+int input_event = -1;
+
+
+
+int input_available()
+{
+return (int)(input_head - input_tail);
+} /* end function input_available */
+
+
+
+int input_peek(int i)
+{
+return input_ring[(input_tail + i) & (INPUT_RING_SIZE - 1)];
+} /* end function input_peek */
+
+
+
+/* the glyph of the character at i, a sequence the input ends in the middle of is GLYPH_UNKNOWN */
+int utf8_peek(int i, int *len)
+{
+int c, k, n;
+unsigned char s[4];
+
+n = input_available() - i;
+if(n > 4) n = 4;
+
+for(k = 0; k < n; k++)
+	{
+	s[k] = input_peek(i + k);
+	}
+
+c = utf8_glyph(s, n, len);
+if( (c == UTF8_MORE) && input_eof)
+	{
+	*len = n;
+	return GLYPH_UNKNOWN;
+	}
+
+return c;
+} /* end function utf8_peek */
+
+
+
+void input_consume(int n)
+{
+input_tail += n;
+
+} /* end function input_consume */
+
+
+
+/* horizontal scroll renders input into the strip as soon as it arrives */
+void input_drain()
+{
+int c, len;
+
+if(scroll_mode != SCROLL_LEFT) return;
+
+while(input_available() && strip_room() )
+	{
+	c = utf8_peek(0, &len);
+	if(c == UTF8_MORE) break;
+
+	strip_append(c);
+	input_consume(len);
+	}
+
+} /* end function input_drain */
+
+
+
+void input_ready()
+{
+int n, offset, len;
+
+offset = input_head & (INPUT_RING_SIZE - 1);
+len = INPUT_RING_SIZE - input_available();
+if(len > INPUT_RING_SIZE - offset) len = INPUT_RING_SIZE - offset;
+
+n = read(0, input_ring + offset, len);
+if(n > 0)
+	{
+	input_head += n;
+	input_bytes += n;
+	}
+else if(n == 0)
+	{
+	input_eof = 1;
+	}
+else if( (errno != EINTR) && (errno != EAGAIN) )
+	{
+	perror("input_ready(): read");
+	input_eof = 1;
+	}
+
+input_drain();
+
+task_wake(TASK_SCROLL);
+
+} /* end function input_ready */
+
+
+
+void input_start()
+{
+input_event = event_add(0, input_ready);
+
+} /* end function input_start */
+
+
+
+/* wait for input only while there is room for it */
+void input_update()
+{
+if(input_event < 0) return;
+
+if(input_eof || (input_available() == INPUT_RING_SIZE) ) event_fd[input_event].fd = -1;
+else event_fd[input_event].fd = 0;
+
+} /* end function input_update */
+
+
+
+/* sleep until an event source is ready or the deadline on the timeline */
+void event_wait(int64_t deadline)
+{
+int i, n;
+int64_t wait;
+struct timespec ts, *timeout;
+
+input_update();
+
+timeout = NULL;
+if(deadline != NO_DEADLINE)
+	{
+	wait = deadline - timeline_ns();
+	if(wait < 0) wait = 0;
+
+	ts.tv_sec = wait / 1000000000LL;
+	ts.tv_nsec = wait % 1000000000LL;
+	timeout = &ts;
+	}
+
+n = ppoll(event_fd, event_sources, timeout, NULL);
+if(n <= 0) return;
+
+for(i = 0; i < event_sources; i++)
+	{
+	if(event_fd[i].revents & (POLLIN | POLLHUP | POLLERR) )
+		{
+		event_handler[i]();
+		}
+	}
+
+} /* end function event_wait */
+
+
+
+/*
+File source.
+The directory of the -f file is watched with inotify, so both a rewrite in place and a rename over the file
+(atomic update) are seen within milliseconds, without polling.
+The file is kept open and read with pread(), it is reopened when the name points to a new inode.
+A missing file keeps the current text until it shows up again.
+If inotify is not available the file is checked every -q seconds.
+*/
+#define FILE_CONTENT_SIZE		1024
+
+int file_fd = -1;
+int file_inotify = -1;
+char file_dir[MAX_FILENAME_LEN];
+char *file_base;
+char file_content[FILE_CONTENT_SIZE];
+int file_content_len = -1;
+int file_missing;
+
+
+
+void file_load()
+{
+int n, len;
+struct stat path_stat, fd_stat;
+char buffer[FILE_CONTENT_SIZE];
+
+if(stat(filename, &path_stat) < 0)
+	{
+	if(!file_missing) fprintf(stderr, "Unable to open the file for reading\n");
+	file_missing = 1;
+
+	return;
+	}
+
+// new inode after a rename, or first time
+if( (file_fd < 0) || (fstat(file_fd, &fd_stat) < 0) ||\
+(fd_stat.st_ino != path_stat.st_ino) || (fd_stat.st_dev != path_stat.st_dev) )
+	{
+	if(file_fd >= 0) close(file_fd);
+
+	file_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if(file_fd < 0)
+		{
+		if(!file_missing) fprintf(stderr, "Unable to open the file for reading\n");
+		file_missing = 1;
+
+		return;
+		}
+	}
+
+file_missing = 0;
+
+n = pread(file_fd, buffer, sizeof(buffer), 0);
+if(n < 0) return;
+
+// nothing changed, nothing to render
+if( (n == file_content_len) && (memcmp(buffer, file_content, n) == 0) ) return;
+
+memcpy(file_content, buffer, n);
+file_content_len = n;
+
+// read until (and strip) the first \n
+for(len = 0; len < n; len++)
+	{
+	if(buffer[len] == '\n') break;
+	}
+
+// Remove the current text
+memset(&text[0], 0, sizeof(text) );
+utf8_text(text, sizeof(text), buffer, len);
+
+} /* end function file_load */
+
+
+
+void file_event()
+{
+int n, changed;
+char *p;
+struct inotify_event *event;
+char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event) ) ) );
+
+changed = 0;
+while(1)
+	{
+	n = read(file_inotify, buffer, sizeof(buffer) );
+	if(n <= 0) break;
+
+	for(p = buffer; p < buffer + n; p += sizeof(struct inotify_event) + event->len)
+		{
+		event = (struct inotify_event *)p;
+
+		if(event->len && (strcmp(event->name, file_base) == 0) ) changed = 1;
+		}
+	}
+
+if(changed) file_load();
+
+} /* end function file_event */
+
+
+
+/* fallback without inotify */
+int file_task()
+{
+file_load();
+
+return file_read_frequency * 1000;
+} /* end function file_task */
+
+
+
+void file_start()
+{
+char *p;
+
+strcpy(file_dir, filename);
+
+p = strrchr(file_dir, '/');
+if(p)
+	{
+	*p = 0;
+	if(p == file_dir) strcpy(file_dir, "/");
+
+	file_base = filename + (p - file_dir) + 1;
+	}
+else
+	{
+	strcpy(file_dir, ".");
+
+	file_base = filename;
+	}
+
+file_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+if( (file_inotify >= 0) && (inotify_add_watch(file_inotify, file_dir, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0) )
+	{
+	event_add(file_inotify, file_event);
+
+	file_load();
+
+	return;
+	}
+
+fprintf(stderr, "No inotify on %s, checking the file every %d seconds\n", file_dir, file_read_frequency);
+
+if(file_inotify >= 0) close(file_inotify);
+file_inotify = -1;
+
+task_start(TASK_FILE, file_task, 0);
+
+} /* end function file_start */
+
+
+
+/*
+Brightness.
+-b sets a fixed brightness, 1 to 16, or a schedule in local time, for example -b 7:00=16,20:00=8,23:30=2.
+A level holds from its time until the next one, over midnight the last one of the day holds.
+Level 0 is display off, -b 7:00=16,22:00=0 keeps the panel dark and the refresh thread parked over night.
+The schedule is checked every minute. The stats socket command brightness overrides it at runtime
+until brightness auto.
+*/
+#define BRIGHTNESS_POINTS		24
+
+struct brightness_point
+	{
+	int minute;				/* of the day */
+	int level;
+	};
+
+struct brightness_point brightness_schedule[BRIGHTNESS_POINTS];
+int brightness_points;
+int brightness_set = -1;	/* set at runtime, -1 is follow the schedule */
+
+
+
+/* level or time=level,time=level... returns -1 on a syntax error */
+int brightness_parse(char *arg)
+{
+int i, hour, minute, level, n;
+char *p;
+struct brightness_point point;
+
+brightness_points = 0;
+
+if(sscanf(arg, "%d%n", &level, &n) == 1 && arg[n] == 0)
+	{
+	if( (level < 0) || (level > BRIGHTNESS_MAX) ) return -1;
+
+	brightness_schedule[0].minute = 0;
+	brightness_schedule[0].level = level;
+	brightness_points = 1;
+
+	return 0;
+	}
+
+for(p = arg; *p; p += n)
+	{
+	if(brightness_points == BRIGHTNESS_POINTS) return -1;
+
+	n = 0;
+	if(sscanf(p, "%d:%d=%d%n", &hour, &minute, &level, &n) != 3) return -1;
+	if( (hour < 0) || (hour > 23) || (minute < 0) || (minute > 59) || (level < 0) || (level > BRIGHTNESS_MAX) ) return -1;
+
+	if(p[n] == ',') n++;
+	else if(p[n] != 0) return -1;
+
+	// keep them in order of the time of day
+	point.minute = (hour * 60) + minute;
+	point.level = level;
+	for(i = brightness_points; (i > 0) && (brightness_schedule[i - 1].minute > point.minute); i--)
+		{
+		brightness_schedule[i] = brightness_schedule[i - 1];
+		}
+	brightness_schedule[i] = point;
+	brightness_points++;
+	}
+
+return brightness_points ? 0 : -1;
+} /* end function brightness_parse */
+
+
+
+/* the level for now according to the schedule */
+int brightness_scheduled()
+{
+int i, minute, level;
+time_t now;
+struct tm *tm;
+
+if(!brightness_points) return BRIGHTNESS_MAX;
+
+now = time(0);
+tm = localtime(&now);
+minute = (tm->tm_hour * 60) + tm->tm_min;
+
+level = brightness_schedule[brightness_points - 1].level;
+for(i = 0; i < brightness_points; i++)
+	{
+	if(brightness_schedule[i].minute <= minute) level = brightness_schedule[i].level;
+	}
+
+return level;
+} /* end function brightness_scheduled */
+
+
+
+/* wake the refresh thread when the display was off */
+void brightness_store(int level)
+{
+pthread_mutex_lock(&refresh_mutex);
+atomic_store(&brightness, level);
+pthread_cond_signal(&refresh_wake);
+pthread_mutex_unlock(&refresh_mutex);
+
+} /* end function brightness_store */
+
+
+
+void brightness_update()
+{
+if(brightness_set >= 0) brightness_store(brightness_set);
+else brightness_store(brightness_scheduled() );
+
+} /* end function brightness_update */
+
+
+
+/* on every minute of the wall clock */
+int brightness_task()
+{
+struct timespec ts;
+
+brightness_update();
+
+clock_gettime(CLOCK_REALTIME, &ts);
+
+return 60000 - ( (ts.tv_sec % 60) * 1000) - (ts.tv_nsec / 1000000);
+} /* end function brightness_task */
+
+
+
+void brightness_start()
+{
+brightness_update();
+
+if(brightness_points > 1) task_start(TASK_BRIGHTNESS, brightness_task, 0);
+
+} /* end function brightness_start */
+
+
+
+/*
+Stats socket.
+-S path opens a Unix stream socket, a client sends one command line, gets the answer and the connection is closed.
+stats, or no command at all, answers the telemetry in the Prometheus text format, for example from cron
+for the node exporter textfile collector:
+ socat -u UNIX-CONNECT:/run/fds132.sock - < /dev/null > /var/lib/node_exporter/fds132.prom
+ echo stats | nc -U /run/fds132.sock
+One client at a time, a new connection closes the one before, all of it runs in the main thread.
+*/
+#define STATS_COMMAND_MAX		256
+#define STATS_REPLY_MAX			32768
+
+struct stats_command
+	{
+	char *name;
+	void (*run)(char *arg);
+	char *help;
+	};
+
+char *stats_path;
+int stats_fd = -1;
+int stats_event = -1;
+int stats_client_event = -1;
+char stats_command_line[STATS_COMMAND_MAX];
+int stats_command_len;
+char stats_reply[STATS_REPLY_MAX];
+int stats_reply_len;
+
+
+
+void stats_printf(char *format, ...)
+{
+int n;
+va_list ap;
+
+va_start(ap, format);
+n = vsnprintf(stats_reply + stats_reply_len, STATS_REPLY_MAX - stats_reply_len, format, ap);
+va_end(ap);
+
+if(n < 0) return;
+
+stats_reply_len += n;
+if(stats_reply_len > STATS_REPLY_MAX - 1) stats_reply_len = STATS_REPLY_MAX - 1;
+
+} /* end function stats_printf */
+
+
+
+void stats_counter(char *name, char *help, uint64_t value)
+{
+stats_printf("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+
+} /* end function stats_counter */
+
+
+
+/* labels may be empty, help only on the first of a family */
+void stats_histogram(char *name, char *help, char *labels, struct histogram *h)
+{
+int i;
+uint64_t count;
+char *comma;
+
+if(help) stats_printf("# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+comma = *labels ? "," : "";
+
+count = 0;
+for(i = 0; i < HIST_BUCKETS; i++)
+	{
+	count += atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+
+	if(i < HIST_BUCKETS - 1) stats_printf("%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, comma, (1u << i) * 1e-6, (unsigned long long)count);
+	else stats_printf("%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, comma, (unsigned long long)count);
+	}
+
+if(*labels)
+	{
+	stats_printf("%s_sum{%s} %.9f\n", name, labels, atomic_load_explicit(&h->sum_ns, memory_order_relaxed) * 1e-9);
+	stats_printf("%s_count{%s} %llu\n", name, labels, (unsigned long long)count);
+	}
+else
+	{
+	stats_printf("%s_sum %.9f\n", name, atomic_load_explicit(&h->sum_ns, memory_order_relaxed) * 1e-9);
+	stats_printf("%s_count %llu\n", name, (unsigned long long)count);
+	}
+
+} /* end function stats_histogram */
+
+
+
+void stats_metrics(char *arg)
+{
+int i;
+char labels[32];
+
+stats_printf("# HELP fds132_info Program version and GPIO backend.\n# TYPE fds132_info gauge\n");
+stats_printf("fds132_info{version=\"%s\",backend=\"%s\"} 1\n", PROGRAM_VERSION, backend->name);
+stats_printf("# HELP fds132_bit_delay_seconds Delay after each GPIO write.\n# TYPE fds132_bit_delay_seconds gauge\n");
+stats_printf("fds132_bit_delay_seconds %.9f\n", bit_delay_ns * 1e-9);
+stats_printf("# HELP fds132_brightness Lit part of the row period in 16ths, 0 is display off.\n# TYPE fds132_brightness gauge\n");
+stats_printf("fds132_brightness %d\n", atomic_load(&brightness) );
+stats_printf("# HELP fds132_bitplanes Bits per pixel.\n# TYPE fds132_bitplanes gauge\n");
+stats_printf("fds132_bitplanes %d\n", gray_planes);
+
+stats_counter("fds132_frames_shown_total", "Frames scanned out.", atomic_load(&frames_shown) );
+stats_counter("fds132_frames_published_total", "Frames compiled and handed to the refresh thread.", frames_published);
+stats_counter("fds132_chars_rendered_total", "Characters rendered from the font into the framebuffer.", chars_rendered);
+stats_counter("fds132_input_bytes_total", "Bytes read from stdin.", input_bytes);
+
+stats_histogram("fds132_row_seconds", "Time from one row select to the next, the lit time of a row.", "", &row_hist);
+stats_counter("fds132_row_overruns_total", "Rows that took longer to shift in than the row time.", atomic_load(&row_overruns) );
+stats_histogram("fds132_frame_seconds", "Time to scan out one frame.", "", &frame_hist);
+stats_histogram("fds132_frame_interval_seconds", "Time from the start of one frame to the start of the next.", "", &interval_hist);
+
+for(i = 0; i < TASKS; i++)
+	{
+	snprintf(labels, sizeof(labels), "task=\"%s\"", task_name[i]);
+	stats_histogram("fds132_task_lateness_seconds", i ? NULL : "How late a task ran after its deadline.", labels, &task_lateness[i]);
+	}
+
+stats_printf("# HELP fds132_task_missed_deadlines_total Deadlines given up on after a stall.\n# TYPE fds132_task_missed_deadlines_total counter\n");
+for(i = 0; i < TASKS; i++)
+	{
+	stats_printf("fds132_task_missed_deadlines_total{task=\"%s\"} %llu\n", task_name[i], (unsigned long long)task_missed[i]);
+	}
+
+} /* end function stats_metrics */
+
+
+
+/* brightness [0-16 | off | auto] */
+void stats_brightness(char *arg)
+{
+int level, n;
+
+if(strcmp(arg, "auto") == 0)
+	{
+	brightness_set = -1;
+	brightness_update();
+	}
+else if(strcmp(arg, "off") == 0)
+	{
+	brightness_set = 0;
+	brightness_update();
+	}
+else if(*arg)
+	{
+	if( (sscanf(arg, "%d%n", &level, &n) != 1) || arg[n] || (level < 0) || (level > BRIGHTNESS_MAX) )
+		{
+		stats_printf("brightness is 0 to %d, off or auto\n", BRIGHTNESS_MAX);
+
+		return;
+		}
+
+	brightness_set = level;
+	brightness_update();
+	}
+
+stats_printf("brightness %d%s\n", atomic_load(&brightness), (brightness_set >= 0) ? "" : " auto");
+
+} /* end function stats_brightness */
+
+
+
+void stats_help(char *arg);
+
+struct stats_command stats_commands[] =
+	{
+	{ "stats",		stats_metrics,		"telemetry in the Prometheus text format, also for an empty command" },
+	{ "brightness",	stats_brightness,	"[0-16 | off | auto] show or set the brightness, 0 and off are display off, auto follows -b" },
+	{ "help",		stats_help,			"this list" },
+	{ NULL, NULL, NULL }
+	};
+
+
+
+void stats_help(char *arg)
+{
+int i;
+
+for(i = 0; stats_commands[i].name; i++)
+	{
+	stats_printf("%-12s %s\n", stats_commands[i].name, stats_commands[i].help);
+	}
+
+} /* end function stats_help */
+
+
+
+/* command [argument] */
+void stats_run(char *line)
+{
+int i, len;
+char *arg;
+
+len = strcspn(line, " \t");
+arg = line + len + strspn(line + len, " \t");
+line[len] = 0;
+
+if(len == 0)
+	{
+	stats_metrics(arg);
+
+	return;
+	}
+
+for(i = 0; stats_commands[i].name; i++)
+	{
+	if(strcmp(stats_commands[i].name, line) == 0)
+		{
+		stats_commands[i].run(arg);
+
+		return;
+		}
+	}
+
+stats_printf("unknown command %s, try help\n", line);
+
+} /* end function stats_run */
+
+
+
+void stats_client_close()
+{
+close(event_fd[stats_client_event].fd);
+event_fd[stats_client_event].fd = -1;
+
+} /* end function stats_client_close */
+
+
+
+/* collect the command line, answer once it is complete or the client is done sending */
+void stats_client_ready()
+{
+int n, fd;
+char *p;
+
+fd = event_fd[stats_client_event].fd;
+
+n = read(fd, stats_command_line + stats_command_len, STATS_COMMAND_MAX - 1 - stats_command_len);
+if( (n < 0) && ( (errno == EINTR) || (errno == EAGAIN) ) ) return;
+
+if(n > 0) stats_command_len += n;
+stats_command_line[stats_command_len] = 0;
+
+p = strpbrk(stats_command_line, "\r\n");
+if(p) *p = 0;
+else if( (n > 0) && (stats_command_len < STATS_COMMAND_MAX - 1) ) return;
+
+stats_reply_len = 0;
+if(n >= 0) stats_run(stats_command_line);
+
+// a client that is already gone is EPIPE, not a SIGPIPE that would end the display without blanking it
+if(stats_reply_len && (send(fd, stats_reply, stats_reply_len, MSG_NOSIGNAL) < 0) && (errno != EPIPE) && verbose)
+	{
+	perror("stats_client_ready(): send");
+	}
+
+stats_client_close();
+
+} /* end function stats_client_ready */
+
+
+
+void stats_accept()
+{
+int fd;
+
+fd = accept4(stats_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+if(fd < 0) return;
+
+if(event_fd[stats_client_event].fd >= 0) stats_client_close();
+
+event_fd[stats_client_event].fd = fd;
+stats_command_len = 0;
+
+} /* end function stats_accept */
+
+
+
+void stats_start()
+{
+struct sockaddr_un addr;
+struct stat path_stat;
+
+if(strlen(stats_path) >= sizeof(addr.sun_path) )
+	{
+	fprintf(stderr, "stats socket path too long: %s\n", stats_path);
+	exit(1);
+	}
+
+// a socket left behind by an earlier run, nothing else is removed
+if( (lstat(stats_path, &path_stat) == 0) && S_ISSOCK(path_stat.st_mode) ) unlink(stats_path);
+
+stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+memset(&addr, 0, sizeof(addr) );
+addr.sun_family = AF_UNIX;
+strcpy(addr.sun_path, stats_path);
+
+if( (stats_fd < 0) || (bind(stats_fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0) || (listen(stats_fd, 4) < 0) )
+	{
+	fprintf(stderr, "can't open stats socket %s: %s\n", stats_path, strerror(errno) );
+	exit(1);
+	}
+
+stats_event = event_add(stats_fd, stats_accept);
+stats_client_event = event_add(-1, stats_client_ready);
+
+stats_enabled = 1;
+
+} /* end function stats_start */
+
+
+
+/*
+Shutdown.
+SIGINT, SIGTERM and SIGHUP are blocked in every thread and read from a signalfd in the event loop, so they
+end the program from the main thread, between tasks. display_exit() has the refresh thread leave the panel
+dark with nothing latched, killed in the middle of a row that row would stay lit, then removes the stats socket.
+A GPIO write that fails in the refresh thread is passed to the main thread through an eventfd the same way.
+*/
+int signal_fd = -1;
+
+
+
+/* stop the refresh with the panel dark, then exit */
+void display_exit(int status)
+{
+if(refresh_running)
+	{
+	pthread_mutex_lock(&refresh_mutex);
+	atomic_store(&refresh_quit, 1);
+	pthread_cond_signal(&refresh_wake);
+	pthread_mutex_unlock(&refresh_mutex);
+
+	pthread_join(refresh_tid, NULL);
+	}
+
+if(stats_fd >= 0) unlink(stats_path);
+
+exit(status);
+} /* end function display_exit */
+
+
+
+void signal_ready()
+{
+struct signalfd_siginfo info;
+
+if(read(signal_fd, &info, sizeof(info) ) != sizeof(info) ) return;
+
+if(verbose) fprintf(stderr, "%s, display off\n", strsignal(info.ssi_signo) );
+
+display_exit(0);
+} /* end function signal_ready */
+
+
+
+void backend_fail_ready()
+{
+uint64_t count;
+
+if(read(backend_fail_fd, &count, sizeof(count) ) != sizeof(count) ) return;
+
+display_exit(1);
+} /* end function backend_fail_ready */
+
+
+
+/* before the refresh thread starts, it inherits the blocked signals */
+void signal_start()
+{
+sigset_t signals;
+
+sigemptyset(&signals);
+sigaddset(&signals, SIGINT);
+sigaddset(&signals, SIGTERM);
+sigaddset(&signals, SIGHUP);
+
+if( (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) || ( (signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC) ) < 0) )
+	{
+	perror("signalfd");
+	exit(1);
+	}
+
+event_add(signal_fd, signal_ready);
+
+// a GPIO write that fails in the refresh thread ends the program here
+backend_fail_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+if(backend_fail_fd < 0)
+	{
+	perror("eventfd");
+	exit(1);
+	}
+
+event_add(backend_fail_fd, backend_fail_ready);
+
+} /* end function signal_start */
+
+
+
+/*
+Clock source.
+With -d the text is formatted once per second, woken by a CLOCK_REALTIME timerfd armed on the second boundary,
+so the seconds change exactly when the wall clock does. TFD_TIMER_CANCEL_ON_SET wakes us when the clock is set,
+then the timer is armed again on the new time.
+*/
+int date_fd = -1;
+
+
+
+void date_format(time_t now)
+{
+int len;
+struct tm *local_time;
+char temp[1024];
+
+local_time = localtime(&now);
+
+// big digits, with -L 2 the date below them
+if(large_glyph && (large_scale == 3) ) len = strftime(temp, sizeof(temp), "%H:%M", local_time);
+else if(large_glyph) len = strftime(temp, sizeof(temp), "%H:%M:%S\n%a %d %m %Y", local_time);
+// with -F a line each, the widths are not known here
+else if(font) len = strftime(temp, sizeof(temp), "%d %m %Y\n%H:%M:%S\n%A", local_time);
+else len = strftime(temp, sizeof(temp), "  %d %m %Y      %H:%M:%S       %A    ", local_time);
+utf8_text(text, sizeof(text), temp, len);
+
+} /* end function date_format */
+
+
+
+void date_arm()
+{
+struct timespec ts;
+struct itimerspec its;
+
+clock_gettime(CLOCK_REALTIME, &ts);
+
+its.it_value.tv_sec = ts.tv_sec + 1;
+its.it_value.tv_nsec = 0;
+its.it_interval.tv_sec = 1;
+its.it_interval.tv_nsec = 0;
+
+if(timerfd_settime(date_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+	{
+	perror("date_arm(): timerfd_settime");
+	display_exit(1);
+	}
+
+} /* end function date_arm */
+
+
+
+void date_event()
+{
+uint64_t expirations;
+struct timespec ts;
+
+if(read(date_fd, &expirations, sizeof(expirations) ) < 0)
+	{
+	if(errno == ECANCELED) date_arm(); // clock was set
+	else if(errno != EAGAIN) perror("date_event(): read");
+	}
+
+// the second that has started, even if the event is served late
+clock_gettime(CLOCK_REALTIME, &ts);
+
+date_format(ts.tv_sec);
+
+} /* end function date_event */
+
+
+
+void date_start()
+{
+date_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+if(date_fd < 0)
+	{
+	perror("date_start(): timerfd_create");
+	exit(1);
+	}
+
+date_arm();
+event_add(date_fd, date_event);
+
+date_format(time(0) );
+
+} /* end function date_start */
+
+
+
+int fireworks_task()
+{
+int j;
+float fa;
+
+/* create a landscape on the bottom line */
+for(j = 0; j < 15; j++)
+	{
+	text[j + 30] = fireworks_landscape[j];
+	}
+
+input_line_cnt++;
+if(input_line_cnt == 1)
+	{
+	/* generate sparse random '|' on line 2 */
+	for(j = 0; j < 15; j++)
+		{
+		fa =  random();
+
+		if(fa > (RAND_MAX / 16) )
+			text[j + 15] = ' ';
+		else
+			text[j + 15] = 4;
+		}
+	}
+else if(input_line_cnt == 2)
+	{
+	/* copy up line and replace '|' code 4 by '*' */
+	for(j = 0; j < 15; j++)
+		{
+		if(text[j + 15] == 4)
+			{
+			text[j] = '*';
+			}
+		else
+			{
+			text[j] = ' ';
+			}
+
+		/* clear second line */
+		text[j + 15] = 0;
+		}
+
+	input_line_cnt = 0;
+	}
+
+return scroll_delay;
+} /* end function fireworks_task */
+
+
+
+int snow_task()
+{
+int j;
+float fa;
+
+/* create a landscape on the bottom line */
+for(j = 0; j < 15; j++)
+	{
+	text[j + 30] = snow_landscape[j];
+	}
+
+/* copy down topline */
+for(j = 0; j < 15; j++)
+	{
+	text[j + 15] = text[j];
+
+	/* clear to line */
+	text[j] = ' ';
+	}
+
+/* generate random snow on top line */
+for(j = 0; j < 15; j++)
+	{
+	fa =  random();
+
+	if(fa > (RAND_MAX / 2) )
+		text[j]  = ' ';
+	else
+		text[j] = '*';
+	}
+
+return scroll_delay;
+} /* end function snow_task */
+
+
+
+/* time until the next scroll step, after line 3 wait longer */
+int scroll_wait()
+{
+if(line_cnt == 3) return scroll_delay + three_line_delay;
+
+return scroll_delay;
+} /* end function scroll_wait */
+
+
+
+#define LINE_OK					0
+#define LINE_FF					1
+#define LINE_EOF				2
+#define LINE_WAIT				3
+
+/* take one line of at most 15 characters, or 90 pixels with -F, from the input, but only once it is complete */
+int read_line(char *line)
+{
+int c, i, n, x, len;
+
+memset(line, 0, MATRIX_LINE_MAX);
+
+i = 0;
+x = 0;
+for(n = 0; n < input_available(); n += len)
+	{
+	c = utf8_peek(n, &len);
+
+	// the rest of a character is still to come
+	if(c == UTF8_MORE) return LINE_WAIT;
+
+	if(c == 10) // LF, line feed
+		{
+		input_consume(n + 1);
+		return LINE_OK;
+		}
+
+	if(c == 12) // FF, form feed
+		{
+		input_consume(n + 1);
+		return LINE_FF;
+		}
+
+	if( (c != 10)  && (c != 13) && font) // the character that does not fit starts the next line
+		{
+		x += font->glyph[c].width;
+		if( (x > MATRIX_LINE_PIXELS) || (i == MATRIX_LINE_MAX) )
+			{
+			input_consume(n);
+			return LINE_OK;
+			}
+
+		line[i] = c;
+		i++;
+		}
+	else if( (c != 10)  && (c != 13) ) // skip any LF, CR
+		{
+		line[i] = c;
+		i++;
+		if(i == MATRIX_LINE_CHARS)
+			{
+			input_consume(n + len);
+			return LINE_OK;
+			}
+		}
+
+	}
+
+if(!input_eof) return LINE_WAIT;
+
+input_consume(n);
+
+if(exit_on_eof_flag)
+	{
+	display_exit(0);
+	}
+
+text_flag = 1;
+
+return LINE_EOF;
+} /* end function read_line */
+
+
+
+/* vertical scroll, the new line slides in one pixel row per step, then waits */
+int vscroll_task()
+{
+int status, step_ms;
+char line[MATRIX_LINE_MAX];
+static int steps;
+
+step_ms = scroll_delay / MATRIX_ROWS;
+if(step_ms > VSCROLL_STEP_MS) step_ms = VSCROLL_STEP_MS;
+
+if(steps == 0)
+	{
+	status = read_line(line);
+	if(status == LINE_WAIT) return TASK_WAIT;
+
+	if(verbose)
+		fprintf(stderr, "vscroll_task(): status=%d line_cnt=%d line=%.15s\n", status, line_cnt, line);
+
+	if(status == LINE_FF)
+		{
+		// start again at top or bottom, clear screen
+		line_cnt = 0;
+
+		vcanvas_clear();
+		vcanvas_to_framebuffer();
+
+		return scroll_wait();
+		}
+
+	if(line_cnt == 3) line_cnt = 0;
+	line_cnt++;
+
+	/* render the new line off screen */
+	if(scroll_mode == SCROLL_UP) vcanvas_render_line(vcanvas_top + VCANVAS_VISIBLE, line);
+	else vcanvas_render_line(vcanvas_top - MATRIX_ROWS, line);
+
+	steps = MATRIX_ROWS;
+	}
+
+if(scroll_mode == SCROLL_UP) vcanvas_top++;
+else vcanvas_top--;
+
+vcanvas_to_framebuffer();
+
+steps--;
+if(steps) return step_ms;
+
+// EOF, the last line is in
+if(text_flag) return -1;
+
+return scroll_wait() - (MATRIX_ROWS * step_ms);
+} /* end function vscroll_task */
+
+
+
+/* horizontal scroll, one pixel per step, one character per scroll_delay */
+int marquee_task()
+{
+static int step;
+
+if(strip_pending() <= 0)
+	{
+	input_drain();
+
+	if(strip_pending() <= 0)
+		{
+		if(!input_eof) return TASK_WAIT;
+
+		if(exit_on_eof_flag)
+			{
+			display_exit(0);
+			}
+
+		text_flag = 1;
+
+		return -1;
+		}
+	}
+
+strip_view++;
+strip_to_framebuffer();
+
+/* spread scroll_delay over the pixel steps of a character, without accumulating rounding errors */
+step++;
+if(step == FONT_PITCH) step = 0;
+
+return ( (scroll_delay * (step + 1) ) / FONT_PITCH) - ( (scroll_delay * step) / FONT_PITCH);
+} /* end function marquee_task */
+
+
+
+/* move every gray level one step towards the framebuffer */
+int fade_task()
+{
+int r, p, target, fading;
+
+fading = 0;
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	for(p = 0; p < MATRIX_CHAIN_BITS; p++)
+		{
+		target = ( (framebuffer[r][p >> 5] >> (p & 31) ) & 1) ? gray_level[p / MATRIX_LINE_PIXELS] : 0;
+
+		if(gray[r][p] < target) gray[r][p]++;
+		else if(gray[r][p] > target) gray[r][p]--;
+		else continue;
+
+		fading = 1;
+		}
+	}
+
+if(!fading) return -1;
+
+framebuffer_dirty = 1;
+
+return gray_fade_ms >> gray_planes;
+} /* end function fade_task */
+
+
+
+/* the framebuffer changed, show it in gray levels now or fade to it */
+void gray_update()
+{
+int r, p;
+
+if(gray_fade_ms)
+	{
+	if(task[TASK_FADE].deadline == NO_DEADLINE) task_start(TASK_FADE, fade_task, 0);
+
+	return;
+	}
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	for(p = 0; p < MATRIX_CHAIN_BITS; p++)
+		{
+		gray[r][p] = ( (framebuffer[r][p >> 5] >> (p & 31) ) & 1) ? gray_level[p / MATRIX_LINE_PIXELS] : 0;
+		}
+	}
+
+} /* end function gray_update */
+
+
+
+/* the level of each text line, the background lines dim */
+void gray_start()
+{
+int line, max, dim;
+
+max = (1 << gray_planes) - 1;
+for(line = 0; line < MATRIX_LINES; line++)
+	{
+	gray_level[line] = max;
+	}
+
+dim = 0;
+if(effect_mode != EFFECT_OFF) dim = 1;
+if(large_glyph && (large_scale == 2) ) dim = 1;
+
+if(dim) gray_level[MATRIX_LINES - 1] = GRAY_DIM(max);
+
+// nothing else has a level in between
+if(!dim && !gray_fade_ms)
+	{
+	fprintf(stderr, "-G %d without a fade time looks the same as -G 1, only effects and -L 2 have a dim line\n", gray_planes);
+	}
+
+} /* end function gray_start */
+
+
+
+/*
+Benchmark.
+Built with make bench as FDS132_benchmark, it runs the real refresh, render and scroll code against
+the simulated display, as fast as it goes: no bit delay, no scroll delay, no refresh thread.
+Every result is a key=value line on stdout, the argument is the run time of each test in milliseconds.
+The simulated panel image is compared bit for bit with the framebuffer, so a faster refresh that
+shows something else is caught too.
+*/
+#ifdef FDS132_BENCHMARK
+#include <sys/utsname.h>
+
+#define BENCH_DEFAULT_MS		500
+#define BENCH_ROW_NS			1000000		/* row period for the idle refresh tests */
+
+int64_t bench_ns;
+
+
+
+/* scan out the published frame until the run time is up */
+void bench_refresh(char *name)
+{
+int64_t start, ns;
+uint64_t frames;
+struct sim_counters before;
+
+before = sim_count;
+frames = 0;
+start = monotonic_ns();
+do
+	{
+	refresh_frame();
+	frames++;
+	ns = monotonic_ns() - start;
+	}
+while(ns < bench_ns);
+
+printf("%s.fps=%.1f\n", name, frames * 1e9 / ns);
+printf("%s.ns_per_bit=%.2f\n", name, (double)ns / (frames * MATRIX_ROWS * MATRIX_CHAIN_BITS) );
+printf("%s.writes_per_frame=%.1f\n", name, (double)(sim_count.writes - before.writes) / frames);
+printf("%s.clock_edges_per_frame=%.1f\n", name, (double)(sim_count.clock_edges - before.clock_edges) / frames);
+printf("%s.data_edges_per_frame=%.1f\n", name, (double)(sim_count.data_edges - before.data_edges) / frames);
+
+} /* end function bench_refresh */
+
+
+
+/* refresh at a fixed row period, spinning or sleeping, and what it costs */
+void bench_idle(char *name, int eco)
+{
+int64_t start, ns, cpu;
+uint64_t frames, overruns;
+struct timespec ts;
+
+eco_flag = eco;
+row_ns = BENCH_ROW_NS;
+row_calibrate();
+timing_level = 0;
+
+stats_enabled = 1;
+overruns = row_overruns;
+
+clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+cpu = ( (int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+
+frames = 0;
+start = monotonic_ns();
+do
+	{
+	refresh_frame();
+	frames++;
+	ns = monotonic_ns() - start;
+	}
+while(ns < bench_ns);
+
+clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+cpu = ( (int64_t)ts.tv_sec * 1000000000LL) + ts.tv_nsec - cpu;
+
+printf("%s.row_us=%.1f\n", name, ns / (frames * MATRIX_ROWS * 1e3) );
+printf("%s.fps=%.1f\n", name, frames * 1e9 / ns);
+printf("%s.cpu_percent=%.1f\n", name, (cpu * 100.0) / ns);
+printf("%s.overruns=%llu\n", name, (unsigned long long)(row_overruns - overruns) );
+
+refresh_pause();
+stats_enabled = 0;
+eco_flag = 0;
+row_ns = 0;
+shift_ns = 0;
+timing_level = 0;
+
+} /* end function bench_idle */
+
+
+
+/* the panel must show exactly what is in the framebuffer, bits beyond the chain are not shown */
+int bench_check()
+{
+int r;
+uint32_t last;
+
+refresh_frame();
+refresh_frame();
+
+last = (1u << (MATRIX_CHAIN_BITS & 31) ) - 1;
+
+for(r = 0; r < MATRIX_ROWS; r++)
+	{
+	if(memcmp(sim_image[r], framebuffer[r], (FB_WORDS - 1) * sizeof(uint32_t) ) != 0) return 0;
+	if( (sim_image[r][FB_WORDS - 1] ^ framebuffer[r][FB_WORDS - 1]) & last) return 0;
+	}
+
+return 1;
+} /* end function bench_check */
+
+
+
+/* display off must leave zeros latched and row 7 selected */
+int bench_off()
+{
+int w, dark;
+
+refresh_off();
+
+dark = (sim_row() == MATRIX_ROWS);
+for(w = 0; w < FB_WORDS; w++)
+	{
+	if(sim_latch[w]) dark = 0;
+	}
+
+printf("display_off.dark=%d\n", dark);
+
+return dark;
+} /* end function bench_off */
+
+
+
+/* change n characters per step, render and compile */
+void bench_render(char *name, int n)
+{
+int i, c;
+int64_t start, ns, render_ns, compile_ns, t;
+uint64_t steps;
+
+steps = 0;
+render_ns = 0;
+compile_ns = 0;
+c = 0;
+start = monotonic_ns();
+do
+	{
+	for(i = 0; i < n; i++)
+		{
+		text[(c + i) % MATRIX_CHARS] = 'A' + ( (c + i) % 26);
+		}
+	c += n;
+
+	t = monotonic_ns();
+	framebuffer_update(text);
+	render_ns += monotonic_ns() - t;
+
+	t = monotonic_ns();
+	publish_frame();
+	compile_ns += monotonic_ns() - t;
+
+	steps++;
+	ns = monotonic_ns() - start;
+	}
+while(ns < bench_ns);
+
+printf("%s.render_ns=%.1f\n", name, (double)render_ns / steps);
+printf("%s.compile_ns=%.1f\n", name, (double)compile_ns / steps);
+
+} /* end function bench_render */
+
+
+
+#define BENCH_TEXTS				64
+
+char bench_text[BENCH_TEXTS][MATRIX_CHARS];
+
+
+
+/* whole texts of any byte values */
+void bench_texts()
+{
+int i, j;
+
+srand(1);
+for(i = 0; i < BENCH_TEXTS; i++)
+	{
+	for(j = 0; j < MATRIX_CHARS; j++)
+		{
+		bench_text[i][j] = rand() & 255;
+		}
+	}
+
+} /* end function bench_texts */
+
+
+
+/* all rows of a full text, no change detection */
+void bench_render_text(char *name, void (*render)(uint32_t fb[MATRIX_ROWS][FB_WORDS], char *s) )
+{
+int64_t start, ns;
+uint64_t texts;
+static uint32_t fb[MATRIX_ROWS][FB_WORDS];
+
+texts = 0;
+ns = 0;
+start = monotonic_ns();
+do
+	{
+	render(fb, bench_text[texts % BENCH_TEXTS]);
+	texts++;
+
+	if(texts % BENCH_TEXTS) continue;
+	ns = monotonic_ns() - start;
+	}
+while(ns < bench_ns);
+
+printf("%s.ns_per_text=%.1f\n", name, (double)ns / texts);
+
+} /* end function bench_render_text */
+
+
+
+/* render_text() must give the same bits as the reference */
+int bench_render_match()
+{
+int i, ok;
+uint32_t ref[MATRIX_ROWS][FB_WORDS], fb[MATRIX_ROWS][FB_WORDS];
+
+ok = 1;
+for(i = 0; i < BENCH_TEXTS; i++)
+	{
+	render_text_reference(ref, bench_text[i]);
+
+	render_text(fb, bench_text[i]);
+	if(memcmp(fb, ref, sizeof(ref) ) != 0) ok = 0;
+	}
+
+printf("render_text.match=%d\n", ok);
+
+return ok;
+} /* end function bench_render_match */
+
+
+
+/* decode s to glyphs over and over */
+void bench_utf8(char *name, char *s)
+{
+int len;
+int64_t start, ns;
+uint64_t chars;
+char glyphs[256];
+
+len = strlen(s);
+chars = 0;
+start = monotonic_ns();
+do
+	{
+	chars += utf8_text(glyphs, sizeof(glyphs), s, len);
+	ns = monotonic_ns() - start;
+	}
+while(ns < bench_ns);
+
+printf("%s.ns_per_char=%.2f\n", name, (double)ns / chars);
+
+} /* end function bench_utf8 */
+
+
+
+/* the -d -L clock line must fit whole, the digits are all as wide so any time will do */
+int bench_large_clock(int scale)
+{
+int n, len, width, ok;
+
+large_scale = scale;
+large_init();
+
+date_format(time(0) );
+for(len = 0; text[len] && (text[len] != '\n'); len++);
+n = large_fit( (unsigned char *)text, len, &width);
+ok = (n == len);
+
+printf("large_clock_%d.width=%d\n", scale, width);
+printf("large_clock_%d.fits=%d\n", scale, ok);
+
+free(large_glyph);
+large_glyph = NULL;
+
+return ok;
+} /* end function bench_large_clock */
+
+
+
+/* fill the input ring with numbered lines */
+void bench_feed()
+{
+int n;
+char line[32];
+uint32_t i;
+
+while(1)
+	{
+	n = sprintf(line, "line %09u\n", input_head);
+	if(INPUT_RING_SIZE - input_available() < n) break;
+
+	for(i = 0; i < n; i++)
+		{
+		input_ring[input_head & (INPUT_RING_SIZE - 1)] = line[i];
+		input_head++;
+		}
+	}
+
+} /* end function bench_feed */
+
+
+
+/* run a scroll task on endless input, every step is compiled */
+void bench_scroll(char *name, int mode, int (*run)() )
+{
+int64_t start, ns;
+uint64_t steps;
+
+scroll_mode = mode;
+scroll_delay = 0;
+three_line_delay = 0;
+input_head = 0;
+input_tail = 0;
+input_eof = 0;
+line_cnt = 0;
+
+if(mode == SCROLL_LEFT) strip_reset();
+else vcanvas_clear();
+
+steps = 0;
+start = monotonic_ns();
+do
+	{
+	if(input_available() < INPUT_RING_SIZE / 2) bench_feed();
+
+	run();
+	steps++;
+
+	if(framebuffer_dirty)
+		{
+		publish_frame();
+		framebuffer_dirty = 0;
+		}
+
+	ns = monotonic_ns() - start;
+	}
+while(ns < bench_ns);
+
+printf("%s.steps_per_s=%.1f\n", name, steps * 1e9 / ns);
+printf("%s.bytes_per_s=%.1f\n", name, input_tail * 1e9 / ns);
+
+} /* end function bench_scroll */
+
+
+
+/* run an effect tick by tick */
+void bench_effect(char *name, int (*run)() )
+{
+int64_t start, ns;
+uint64_t ticks;
+
+memset(text, ' ', MATRIX_CHARS);
+input_line_cnt = 0;
+
+ticks = 0;
+start = monotonic_ns();
+do
+	{
+	run();
+	if(framebuffer_update(text) ) publish_frame();
+
+	ticks++;
+	ns = monotonic_ns() - start;
+	}
+while(ns < bench_ns);
+
+printf("%s.ticks_per_s=%.1f\n", name, ticks * 1e9 / ns);
+printf("%s.ns_per_tick=%.1f\n", name, (double)ns / ticks);
+
+} /* end function bench_effect */
+
+
+
+int main(int argc, char **argv)
+{
+int ok;
+int64_t t;
+struct utsname host;
+
+bench_ns = (int64_t)(argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_MS) * 1000000;
+if(bench_ns <= 0) bench_ns = (int64_t)BENCH_DEFAULT_MS * 1000000;
+
+glyph_init();
+
+backend = &sim_backend;
+backend->open();
+sim_print = 0;
+
+bit_delay_ns = 0;
+calibrate_delay();
+
+uname(&host);
+printf("version=%s\n", PROGRAM_VERSION);
+printf("machine=%s\n", host.machine);
+printf("run_ms=%lld\n", (long long)(bench_ns / 1000000) );
+
+/* empty and full panel */
+memset(text, ' ', MATRIX_CHARS);
+framebuffer_update(text);
+publish_frame();
+bench_refresh("refresh_blank");
+ok = bench_check();
+
+memcpy(text, "FDS132 matrix  display driver  0123456789ABCD", MATRIX_CHARS);
+framebuffer_update(text);
+publish_frame();
+bench_refresh("refresh_text");
+ok &= bench_check();
+ok &= bench_off();
+ok &= bench_check();
+
+/* static text at a fixed refresh rate */
+bench_idle("refresh_spin", 0);
+bench_idle("refresh_eco", 1);
+ok &= bench_check();
+/* a date changes one character per second, a file all of them */
+bench_render("render_1", 1);
+bench_render("render_45", MATRIX_CHARS);
+
+/* the same with the built in font proportional */
+font_load("builtin");
+bench_render("render_proportional_1", 1);
+bench_render("render_proportional_45", MATRIX_CHARS);
+ok &= bench_check();
+free(font);
+font = NULL;
+framebuffer_valid = 0;
+
+/* a line 2 times as high, the glyphs are scaled once */
+ok &= bench_large_clock(2);
+ok &= bench_large_clock(3);
+large_scale = 2;
+t = monotonic_ns();
+large_init();
+printf("large_init.us=%.1f\n", (double)(monotonic_ns() - t) / 1000);
+bench_render("render_large_1", 1);
+bench_render("render_large_45", MATRIX_CHARS);
+ok &= bench_check();
+free(large_glyph);
+large_glyph = NULL;
+large_scale = 0;
+framebuffer_valid = 0;
+
+bench_texts();
+bench_render_text("render_text_reference", render_text_reference);
+#ifdef GLYPH_SIMD
+bench_render_text("render_text_" GLYPH_SIMD, render_text);
+#endif
+ok &= bench_render_match();
+
+bench_utf8("utf8_ascii", "FDS132 matrix  display driver  0123456789ABCD");
+bench_utf8("utf8_latin", "Café Größe 12,50€ «déjà vu» Ærø Señor ½ °C");
+
+bench_scroll("marquee", SCROLL_LEFT, marquee_task);
+ok &= bench_check();
+bench_scroll("scroll_up", SCROLL_UP, vscroll_task);
+ok &= bench_check();
+bench_scroll("scroll_down", SCROLL_DOWN, vscroll_task);
+ok &= bench_check();
+
+bench_effect("snow", snow_task);
+ok &= bench_check();
+bench_effect("fireworks", fireworks_task);
+ok &= bench_check();
+
+printf("sim_match=%d\n", ok);
+
+exit(ok ? 0 : 1);
+} /* end function main */
+#endif // FDS132_BENCHMARK
+
+
+
+#ifndef FDS132_BENCHMARK
+int main(int argc, char **argv)
+{
+int a, i;
+int lock_memory_flag;
+//int get_temperature_flag;
+//int temperature;
+
+
+setbuf(stdout, NULL);
+
+//strcpy(text, "   PANTELTJE                               ");
+strcpy(text, "                                           ");
+
+
+/*
+GPIO	header Pin
+2		3
+3		5
+4		7
+7		26
+8		24
+9		21
+10		19
+11		23
+14		8
+15		10
+17		11
+18		12
+27		13
+22		15
+23		16
+24		18
+25		22
+*/
+
+
+/* defaults */
+
+verbose = 0;
+exit_on_eof_flag = 0;
+text_flag = 0;
+date_flag = 0;
+large_scale = 0;
+file_flag = 0;
+scroll_delay = 100;
+three_line_delay = 0;
+line_cnt = 0;
+//get_temperature_flag = 0;
+scroll_mode = SCROLL_LEFT;
+effect_mode = EFFECT_OFF;
+input_line_cnt = 0;
+file_read_frequency = 10;
+bit_delay_ns = DEFAULT_BIT_DELAY_NS;
+realtime_priority = 0;
+refresh_cpu = -1;
+lock_memory_flag = 0;
+backend = &mem_backend;
+
+/* end defaults */
+
+
+// -t decodes its text by the code page
+glyph_init();
+
+/* proces any command line arguments */
+while(1)
+	{
+	a = getopt(argc, argv, "a:b:cdeEg:hmn:p:r:s:u:vw:t:x:f:F:q:G:L:S:");
+	if(a == -1) break;
+
+	switch(a)
+		{
+//		case 'c': // temperature
+//			get_temperature_flag = 1;
+//			break;
+		case 'a': // refresh thread CPU
+			refresh_cpu = atoi(optarg);
+			break;
+		case 'b': // brightness or schedule
+			if(brightness_parse(optarg) < 0)
+				{
+				print_usage();
+
+				exit(1);
+				}
+			break;
+		case 'd': // dsiplay date and time
+			date_flag = 1;
+			break;
+		case 'e': // exit on EOF
+			exit_on_eof_flag = 1;
+			break;
+		case 'E': // eco refresh
+			eco_flag = 1;
+			break;
+		case 'g': // GPIO backend
+			backend = find_backend(optarg);
+			if(!backend)
+				{
+				print_usage();
+
+				exit(1);
+				}
+			break;
+    case 'f':
+      file_flag = 1;
+      strncpy(filename, optarg, sizeof(filename) - 1);
+      break;
+		case 'F': // proportional font
+			font_name = strdup(optarg);
+			break;
+		case 'G': // grayscale bitplanes and fade time
+			a = sscanf(optarg, "%d,%d", &gray_planes, &gray_fade_ms);
+			if( (a < 1) || (gray_planes < 1) || (gray_planes > GRAY_PLANES_MAX) || (gray_fade_ms < 0) )
+				{
+				print_usage();
+
+				exit(1);
+				}
+			break;
+		case 'h': // help
+			print_usage();
+			exit(1);
+			break;
+		case 'm': // lock memory
+			lock_memory_flag = 1;
+			break;
+		case 'n': // bit delay in ns
+			bit_delay_ns = atoi(optarg);
+			if(bit_delay_ns < 0)
+				{
+				print_usage();
+
+				exit(1);
+				}
+			break;
+		case 'p': // refresh thread real time priority
+			realtime_priority = atoi(optarg);
+			if( (realtime_priority < 0) || (realtime_priority > 99) )
+				{
+				print_usage();
+
+				exit(1);
+				}
+			break;
+    case 'q':
+      file_read_frequency = atoi(optarg);
+      break;
+		case 'r': // row time in us
+			row_ns = atoi(optarg) * 1000LL;
+			if(row_ns < 0)
+				{
+				print_usage();
+
+				exit(1);
+				}
+			break;
+		case 's': // scroll delay
+			scroll_delay = atoi(optarg);
+			break;
+		case 'L': // large glyphs
+			large_scale = atoi(optarg);
+			if( (large_scale < 2) || (large_scale > LARGE_SCALE_MAX) )
+				{
+				print_usage();
+
+				exit(1);
+				}
+			break;
+		case 'S': // stats socket
+			stats_path = strdup(optarg);
+			break;
+		case 't': // text to display
+			text_flag = 1;
+			utf8_text(text, sizeof(text), optarg, strlen(optarg) );
+			break;
+		case 'u': // scroll mode
+			a =  atoi(optarg);
+			if( (a < 0) || (a > SCROLL_DOWN) )
+				{
+				print_usage();
+
+				exit(1);
+				}
+			scroll_mode = a;
+			break;
+		case 'v': // verbose
+			verbose = 1;
+			break;
+		case 'w':// time to wait after 3 lines displayed
+			three_line_delay = atoi(optarg);
+			break;
+ 		case 'x': // special effect mode
+			effect_mode = atoi(optarg);
+			break;
+        case -1:
+        	break;
+		case '?':
+			if (isprint(optopt) )
+ 				{
+ 				fprintf(stderr, "send_music: unknown option `-%c'.\n", optopt);
+ 				}
+			else
+				{
+				fprintf(stderr, "send_music: unknown option character `\\x%x'.\n", optopt);
+				}
+			print_usage();
+
+			exit(1);
+			break;
+		default:
+			print_usage();
+			exit(1);
+			break;
+		}/* end switch a */
+	}/* end while getopt() */
+
+
+// effects draw on the 15 x 3 grid
+if(font_name && (effect_mode == EFFECT_OFF) ) font_load(font_name);
+
+// the text sources, the scrolling input has lines of its own
+if(large_scale && (effect_mode == EFFECT_OFF) && (date_flag || text_flag || file_flag) ) large_init();
+
+if(gray_planes > 1) gray_start();
+
+backend->open();
+
+calibrate_delay();
+
+// clock and data line low
+sck_l();
+so_l();
+
+
+/*
+MATRIX_SHIFT_REGISTER_CLOCK
+MATRIX_SHIFT_REGISTER_DATA
+MATRIX_STROBE
+MATRIX_ROW_SELECT_A
+MATRIX_ROW_SELECT_B
+MATRIX_ROW_SELECT_C
+*/
+
+
+//#define IO_TEST
+#ifdef IO_TEST
+//a = MATRIX_SHIFT_REGISTER_CLOCK;
+//a = MATRIX_SHIFT_REGISTER_DATA;
+//a = MATRIX_STROBE;
+//a = MATRIX_ROW_SELECT_A;
+//a = MATRIX_ROW_SELECT_B;
+a = MATRIX_ROW_SELECT_C;
+
+while(1)
+	{
+	*(gpio + 7) = a;
+	usleep(100);
+	*(gpio + 10) = a;
+	usleep(100);
+	}
+#endif // IO_TEST
+
+
+// Make sure the environments locale is used
+setlocale(LC_TIME, "");
+
+/* what to run when */
+for(i = 0; i < TASKS; i++)
+	{
+	task_stop(i);
+	}
+
+signal_start();
+
+if(stats_path) stats_start();
+
+brightness_start();
+
+if(date_flag) date_start();
+
+// Make sure the file gets read directly (when the file_flag is set)
+if(file_flag) file_start();
+
+if(effect_mode == EFFECT_FIREWORKS) task_start(TASK_EFFECT, fireworks_task, scroll_delay);
+else if(effect_mode == EFFECT_SNOW) task_start(TASK_EFFECT, snow_task, 0);
+else if(!date_flag && !text_flag && !file_flag)
+	{
+	input_start();
+
+	if(scroll_mode == SCROLL_LEFT)
+		{
+		strip_reset();
+		task_start(TASK_SCROLL, marquee_task, scroll_delay / FONT_PITCH);
+		}
+	else
+		{
+		vcanvas_clear();
+		task_start(TASK_SCROLL, vscroll_task, scroll_delay);
+		}
+	}
+
+/* first frame, then start the refresh thread */
+framebuffer_update(text);
+if(gray_planes > 1) gray_update();
+publish_frame();
+
+if(lock_memory_flag)
+	{
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		{
+		perror("mlockall");
+		}
+	}
+
+a = pthread_create(&refresh_tid, NULL, refresh_thread, NULL);
+if(a)
+	{
+	fprintf(stderr, "Could not start refresh thread: %s\n", strerror(a) );
+	exit(1);
+	}
+refresh_running = 1;
+
+while(1)
+	{
+	run_tasks(timeline_ns() );
+
+	if(framebuffer_update(text) ) framebuffer_dirty = 1;
+
+	if(framebuffer_dirty)
+		{
+		if(gray_planes > 1) gray_update();
+
+		publish_frame();
+		framebuffer_dirty = 0;
+		}
+
+	event_wait(next_deadline() );
+	}
 
 exit(0);
 } /* end function main */
+#endif // FDS132_BENCHMARK